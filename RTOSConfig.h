@@ -8,6 +8,10 @@
 #define configUSE_PREEMPTION		1
 #define configUSE_IDLE_HOOK			1
 #define configUSE_TICK_HOOK			1
+#define configUSE_TICKLESS_IDLE		1
+#ifndef configUSE_PENDSV_SWITCH		/* Set by the Makefile, see PENDSV_SWITCH */
+#define configUSE_PENDSV_SWITCH		0
+#endif
 #define configCPU_CLOCK_HZ			( ( unsigned long ) 72000000 )	
 #define configTICK_RATE_HZ			( ( portTickType ) 100 )
 #define configMAX_PRIORITIES		( ( unsigned portBASE_TYPE ) 5 )
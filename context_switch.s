@@ -1,11 +1,118 @@
 	.syntax unified
 
+	/* Every device vector of the STM32F10x medium density parts, IRQ 0 to
+	 * IRQ_LIMIT - 1, overrides the startup file's Default_Handler */
+	.global WWDG_IRQHandler
+	.thumb_set WWDG_IRQHandler, irq_entry
+	.global PVD_IRQHandler
+	.thumb_set PVD_IRQHandler, irq_entry
+	.global TAMPER_IRQHandler
+	.thumb_set TAMPER_IRQHandler, irq_entry
+	.global RTC_IRQHandler
+	.thumb_set RTC_IRQHandler, irq_entry
+	.global FLASH_IRQHandler
+	.thumb_set FLASH_IRQHandler, irq_entry
+	.global RCC_IRQHandler
+	.thumb_set RCC_IRQHandler, irq_entry
+	.global EXTI0_IRQHandler
+	.thumb_set EXTI0_IRQHandler, irq_entry
+	.global EXTI1_IRQHandler
+	.thumb_set EXTI1_IRQHandler, irq_entry
+	.global EXTI2_IRQHandler
+	.thumb_set EXTI2_IRQHandler, irq_entry
+	.global EXTI3_IRQHandler
+	.thumb_set EXTI3_IRQHandler, irq_entry
+	.global EXTI4_IRQHandler
+	.thumb_set EXTI4_IRQHandler, irq_entry
+	.global DMA1_Channel1_IRQHandler
+	.thumb_set DMA1_Channel1_IRQHandler, irq_entry
+	.global DMA1_Channel2_IRQHandler
+	.thumb_set DMA1_Channel2_IRQHandler, irq_entry
+	.global DMA1_Channel3_IRQHandler
+	.thumb_set DMA1_Channel3_IRQHandler, irq_entry
+	.global DMA1_Channel4_IRQHandler
+	.thumb_set DMA1_Channel4_IRQHandler, irq_entry
+	.global DMA1_Channel5_IRQHandler
+	.thumb_set DMA1_Channel5_IRQHandler, irq_entry
+	.global DMA1_Channel6_IRQHandler
+	.thumb_set DMA1_Channel6_IRQHandler, irq_entry
+	.global DMA1_Channel7_IRQHandler
+	.thumb_set DMA1_Channel7_IRQHandler, irq_entry
+	.global ADC1_2_IRQHandler
+	.thumb_set ADC1_2_IRQHandler, irq_entry
+	.global USB_HP_CAN1_TX_IRQHandler
+	.thumb_set USB_HP_CAN1_TX_IRQHandler, irq_entry
+	.global USB_LP_CAN1_RX0_IRQHandler
+	.thumb_set USB_LP_CAN1_RX0_IRQHandler, irq_entry
+	.global CAN1_RX1_IRQHandler
+	.thumb_set CAN1_RX1_IRQHandler, irq_entry
+	.global CAN1_SCE_IRQHandler
+	.thumb_set CAN1_SCE_IRQHandler, irq_entry
+	.global EXTI9_5_IRQHandler
+	.thumb_set EXTI9_5_IRQHandler, irq_entry
+	.global TIM1_BRK_IRQHandler
+	.thumb_set TIM1_BRK_IRQHandler, irq_entry
+	.global TIM1_UP_IRQHandler
+	.thumb_set TIM1_UP_IRQHandler, irq_entry
+	.global TIM1_TRG_COM_IRQHandler
+	.thumb_set TIM1_TRG_COM_IRQHandler, irq_entry
+	.global TIM1_CC_IRQHandler
+	.thumb_set TIM1_CC_IRQHandler, irq_entry
+	.global TIM2_IRQHandler
+	.thumb_set TIM2_IRQHandler, irq_entry
+	.global TIM3_IRQHandler
+	.thumb_set TIM3_IRQHandler, irq_entry
+	.global TIM4_IRQHandler
+	.thumb_set TIM4_IRQHandler, irq_entry
+	.global I2C1_EV_IRQHandler
+	.thumb_set I2C1_EV_IRQHandler, irq_entry
+	.global I2C1_ER_IRQHandler
+	.thumb_set I2C1_ER_IRQHandler, irq_entry
+	.global I2C2_EV_IRQHandler
+	.thumb_set I2C2_EV_IRQHandler, irq_entry
+	.global I2C2_ER_IRQHandler
+	.thumb_set I2C2_ER_IRQHandler, irq_entry
+	.global SPI1_IRQHandler
+	.thumb_set SPI1_IRQHandler, irq_entry
+	.global SPI2_IRQHandler
+	.thumb_set SPI2_IRQHandler, irq_entry
+	.global USART1_IRQHandler
+	.thumb_set USART1_IRQHandler, irq_entry
+	.global USART2_IRQHandler
+	.thumb_set USART2_IRQHandler, irq_entry
+	.global USART3_IRQHandler
+	.thumb_set USART3_IRQHandler, irq_entry
+	.global EXTI15_10_IRQHandler
+	.thumb_set EXTI15_10_IRQHandler, irq_entry
+	.global RTCAlarm_IRQHandler
+	.thumb_set RTCAlarm_IRQHandler, irq_entry
+	.global USBWakeUp_IRQHandler
+	.thumb_set USBWakeUp_IRQHandler, irq_entry
+
+	.type	irq_entry, %function
+	.global irq_entry
+irq_entry:
+	/* Device interrupts: a handler from irq_register moves the data right
+	 * here, the kernel is only entered when irq_dispatch says so.  Others
+	 * go to the kernel for the tasks in interrupt_wait. */
+	push {r4, lr}
+	mrs r0, ipsr
+	sub r0, r0, #16
+	bl irq_dispatch
+	pop {r4, lr}
+	cmp r0, #0
+	it eq
+	bxeq lr
+
 	.type	SysTick_Handler, %function
 	.global SysTick_Handler
-	.type	USART2_IRQHandler, %function
-	.global USART2_IRQHandler
 SysTick_Handler:
-USART2_IRQHandler:
+.if configUSE_PENDSV_SWITCH
+	/* Get ISR number */
+	mrs r1, ipsr
+	neg r1, r1
+	b kernel_trap
+.else
 	mrs r0, psp
 	stmdb r0!, {r7}
 
@@ -21,10 +128,38 @@ USART2_IRQHandler:
 	msr psr, ip
 
 	bx lr
+.endif
 
 	.type	SVC_Handler, %function
 	.global SVC_Handler
 SVC_Handler:
+	/* Fast path: syscalls listed in syscall_fast[] run right here */
+	ldr r1, =syscall_fast_count
+	ldr r1, [r1]
+	cmp r7, r1
+	bhs svc_slow
+	ldr r1, =syscall_fast
+	ldr r1, [r1, r7, lsl #2]
+	cbz r1, svc_slow
+
+	/* r0-r3 are safe in the exception frame, address it like the
+	 * r0 field of struct user_thread_stack */
+	mrs r0, psp
+	sub r0, r0, #40
+	push {r4, lr}
+	blx r1
+	pop {r4, lr}
+	cmp r0, #0
+	it eq
+	bxeq lr			/* SYSCALL_DONE: straight back to the caller */
+	it gt
+	movgt r7, #0		/* SYSCALL_RESCHED: enter the kernel to reschedule */
+
+svc_slow:
+.if configUSE_PENDSV_SWITCH
+	mov r1, r7
+	b kernel_trap
+.else
 	/* save user state */
 	mrs r0, psp
 	stmdb r0!, {r7}
@@ -33,20 +168,64 @@ SVC_Handler:
 	/* load kernel state */
 	pop {r4, r5, r6, r7, r8, r9, r10, r11, ip, lr}
 	msr psr, ip
-	
+
 	bx lr
+.endif
+
+.if configUSE_PENDSV_SWITCH
+	/* Kernel entry with the event number in r1.  The user state is laid
+	 * out below the exception frame like a switched-out task, without
+	 * moving psp, and the kernel runs right here in handler mode. */
+kernel_trap:
+	mrs r0, psp
+	stmdb r0!, {r7}
+	mov r7, r1
+	stmdb r0!, {r4, r5, r6, r7, r8, r9, r10, r11, lr}
+	push {r4, lr}
+	bl kernel_entry
+	pop {r4, lr}
+
+	/* Restore the user's r7, which held the event number */
+	mrs r0, psp
+	ldr r7, [r0, #-4]
+	bx lr
+
+	/* Deferred context switch, pended by kernel_entry at the lowest
+	 * exception priority so that it runs once all kernel entries are done */
+	.type	PendSV_Handler, %function
+	.global PendSV_Handler
+PendSV_Handler:
+	/* Kernel entries run above PendSV and find the outgoing task through
+	 * psp, so keep them out until the incoming task's psp is in place */
+	cpsid i
+
+	/* save user state */
+	mrs r0, psp
+	stmdb r0!, {r7}
+	stmdb r0!, {r4, r5, r6, r7, r8, r9, r10, r11, lr}
+
+	bl pendsv_switch
+
+	/* load user state of the next task */
+	ldmia r0!, {r4, r5, r6, r7, r8, r9, r10, r11, lr}
+	ldmia r0!, {r7}
+	msr psp, r0
+	cpsie i
+
+	bx lr
+.endif
 
 	.global activate
 activate:
 	/* save kernel state */
 	mrs ip, psr
 	push {r4, r5, r6, r7, r8, r9, r10, r11, ip, lr}
-	
+
 	/* switch to process stack pointer */
 	msr psp, r0
 	mov r0, #3
 	msr control, r0
-	
+
 	/* load user state */
 	pop {r4, r5, r6, r7, r8, r9, r10, r11, lr}
 	pop {r7}
@@ -39,25 +39,20 @@ size_t strlen(const char *s)
 	);
 }
 
-/*different with the puts in stdio, this puts won't print a '\n' or '\r' in the end of line*/
-void puts(char *s)
-{
-	while (*s) {
-		while (USART_GetFlagStatus(USART2, USART_FLAG_TXE) == RESET)
-			/* wait */ ;
-		USART_SendData(USART2, *s);
-		s++;
-	}
-}
-
 #define STACK_SIZE 512 /* Size of task stacks in words */
 #define TASK_LIMIT 8  /* Max number of tasks we can handle */
-#define PIPE_BUF   64 /* Size of largest atomic pipe message */
+#define PIPE_BUF   64 /* Default pipe capacity and largest atomic message */
+#define IRQ_LIMIT  43 /* Device interrupts on the STM32F10x */
+#define TTY_IN_SIZE  128 /* Cooked input, the longest line is one less */
+#define TTY_OUT_SIZE 256 /* Output waiting for the transmitter */
+#define PIPE_POOL_SIZE (PIPE_LIMIT * PIPE_BUF) /* Storage shared by all pipes */
 #define PATH_MAX   32 /* Longest absolute path */
-#define PIPE_LIMIT (TASK_LIMIT * 2)
-
-#define PATHSERVER_FD (TASK_LIMIT + 3) 
-	/* File descriptor of pipe to pathserver */
+#define PATH_LIMIT 8  /* Max number of names in the kernel name table */
+#define PATH_HASH  8  /* Name table hash buckets, a power of two */
+#define PIPE_LIMIT 16 /* Pipe objects, each costing one pipe_ringbuffer */
+#define FD_LIMIT   8  /* Open files per task */
+#define IOV_MAX    8  /* Buffers per readv, writev or mq_receive_batch */
+#define EVENT_LIMIT 4 /* Event groups */
 
 #define PRIORITY_DEFAULT 20
 #define PRIORITY_LIMIT (PRIORITY_DEFAULT * 2 - 1)
@@ -67,9 +62,24 @@ void puts(char *s)
 #define TASK_WAIT_WRITE 2
 #define TASK_WAIT_INTR  3
 #define TASK_WAIT_TIME  4
+#define TASK_WAIT_POLL  5
+#define TASK_WAIT_SEND  6
+#define TASK_WAIT_REPLY 7
+#define TASK_WAIT_RETRY 8 /* Retried as a poller, see retry_syscall */
+#define TASK_WAIT_EVENT 9
+#define TASK_WAIT_NOTIFY 10
+#define TASK_WAIT_MUTEX 11
+#define TASK_WAIT_SEM 12
+#define TASK_WAIT_FUTEX 13
+#define TASK_ZOMBIE 14	/* Exited, until its parent collects the status */
+#define TASK_WAIT_CHILD 15
+#define TASK_FREE 16	/* Slot on task_free */
 
 #define S_IFIFO 1
 #define S_IMSGQ 2
+#define S_IFIRQ 3
+#define S_IFCHAN 4
+#define S_IBUFQ 5
 
 #define O_CREAT 4
 
@@ -99,155 +109,85 @@ struct user_thread_stack {
 /* Task Control Block */
 struct task_control_block {
     struct user_thread_stack *stack;
-    int pid;
+    int pid;	/* Slot index, plus TASK_LIMIT each time the slot is reused */
     int status;
-    int priority;
+    int priority;	/* Effective, may be raised by priority inheritance */
+    int base_priority;	/* As set by setpriority */
+    struct task_control_block *waits_for;	/* Task this one is blocked on */
     struct task_control_block **prev;
     struct task_control_block  *next;
+    struct task_list *list;	/* List this task is linked into */
+    unsigned int wakeup;	/* Tick to wake at while on the timer list */
+    struct task_control_block **timer_prev;
+    struct task_control_block  *timer_next;
+    unsigned char fds[FD_LIMIT];	/* Pipe index + 1 for each open fd, else 0 */
+    unsigned int fd_nonblock;	/* Bit fd set: fd is O_NONBLOCK */
+    unsigned int notify;	/* Pending notification bits */
+    struct task_control_block *parent;	/* NULL once orphaned */
+    int exit_status;	/* Kept for waitpid while TASK_ZOMBIE */
 };
 
+/* Task list, keeps a pointer to the last link for O(1) append */
+struct task_list {
+	struct task_control_block *head;
+	struct task_control_block **tail;
+};
 
 /*Global variables: tasks*/
 struct task_control_block tasks[TASK_LIMIT];
-size_t task_count = 0;
-
-
-/* 
- * pathserver assumes that all files are FIFOs that were registered
- * with mkfifo.  It also assumes a global tables of FDs shared by all
- * processes.  It would have to get much smarter to be generally useful.
- *
- * The first TASK_LIMIT FDs are reserved for use by their respective tasks.
- * 0-2 are reserved FDs and are skipped.
- * The server registers itself at /sys/pathserver
-*/
-#define PATH_SERVER_NAME "/sys/pathserver"
-void pathserver()
-{
-	char paths[PIPE_LIMIT - TASK_LIMIT - 3][PATH_MAX];
-	int npaths = 0;
-	int i = 0;
-	unsigned int plen = 0;
-	unsigned int replyfd = 0;
-	char path[PATH_MAX];
-
-	memcpy(paths[npaths++], PATH_SERVER_NAME, sizeof(PATH_SERVER_NAME));
-
-	while (1) {
-		read(PATHSERVER_FD, &replyfd, 4);
-		read(PATHSERVER_FD, &plen, 4);
-		read(PATHSERVER_FD, path, plen);
-
-		if (!replyfd) { /* mkfifo */
-			int dev;
-			read(PATHSERVER_FD, &dev, 4);
-			memcpy(paths[npaths], path, plen);
-			mknod(npaths + 3 + TASK_LIMIT, 0, dev);
-			npaths++;
-		}
-		else { /* open */
-			/* Search for path */
-			for (i = 0; i < npaths; i++) {
-				if (*paths[i] && strcmp(path, paths[i]) == 0) {
-					i += 3; /* 0-2 are reserved */
-					i += TASK_LIMIT; /* FDs reserved for tasks */
-					write(replyfd, &i, 4);
-					i = 0;
-					break;
-				}
-			}
-
-			if (i >= npaths) {
-				i = -1; /* Error: not found */
-				write(replyfd, &i, 4);
-			}
-		}
-	}
-}
-
-int mkfile(const char *pathname, int mode, int dev)
+size_t task_count = 0;	/* Slots ever used, freed ones are on task_free */
+size_t current_task = 0;
+int current_pid = 0;	/* Pid of current_task, for the mutex fast path */
+struct task_control_block *task_free;	/* Linked through next */
+
+/* The live task with this pid, or NULL once it has exited */
+struct task_control_block *
+task_lookup (int pid)
 {
-	size_t plen = strlen(pathname)+1;
-	char buf[4+4+PATH_MAX+4];
-	(void) mode;
-
-	*((unsigned int *)buf) = 0;
-	*((unsigned int *)(buf + 4)) = plen;
-	memcpy(buf + 4 + 4, pathname, plen);
-	*((int *)(buf + 4 + 4 + plen)) = dev;
-	write(PATHSERVER_FD, buf, 4 + 4 + plen + 4);
-
-	return 0;
-}
+	struct task_control_block *task = &tasks[(unsigned int)pid % TASK_LIMIT];
 
-int mkfifo(const char *pathname, int mode)
-{
-	mkfile(pathname, mode, S_IFIFO);
-	return 0;
+	if (pid < 0 || task->pid != pid || task >= &tasks[task_count] ||
+	    task->status == TASK_FREE || task->status == TASK_ZOMBIE)
+		return NULL;
+	return task;
 }
 
-int open(const char *pathname, int flags)
-{
-	unsigned int replyfd = getpid() + 3;
-	size_t plen = strlen(pathname) + 1;
-	unsigned int fd = -1;
-	char buf[4 + 4 + PATH_MAX];
-	(void) flags;
-
-	*((unsigned int *)buf) = replyfd;
-	*((unsigned int *)(buf + 4)) = plen;
-	memcpy(buf + 4 + 4, pathname, plen);
-	write(PATHSERVER_FD, buf, 4 + 4 + plen);
-	read(replyfd, &fd, 4);
+/* Run queue: one list per priority, plus a bitmap of non-empty lists.
+ * Priority p is bit (31 - p % 32) of word p / 32, so CLZ of the first
+ * non-zero word gives the highest ready priority directly. */
+#define READY_BITMAP_WORDS ((PRIORITY_LIMIT + 32) / 32)
+struct task_list ready_list[PRIORITY_LIMIT + 1];  /* [0 ... 39] */
+unsigned int ready_bitmap[READY_BITMAP_WORDS];
 
-	return fd;
-}
 
-int mq_open(const char *name, int oflag)
+/* attr may be NULL for a PIPE_BUF sized FIFO */
+int mkfifo(const char *pathname, int mode, const struct pipe_attr *attr)
 {
-	if (oflag & O_CREAT)
-		mkfile(name, 0, S_IMSGQ);
-	return open(name, 0);
+	return mkfile(pathname, mode, S_IFIFO, attr);
 }
 
-void serialout(USART_TypeDef* uart, unsigned int intr)
-{
-	int fd;
-	char c;
-	int doread = 1;
-	mkfifo("/dev/tty0/out", 0);
-	fd = open("/dev/tty0/out", 0);
-
-	while (1) {
-		if (doread)
-			read(fd, &c, 1);
-		doread = 0;
-		if (USART_GetFlagStatus(uart, USART_FLAG_TXE) == SET) {
-			USART_SendData(uart, c);
-			USART_ITConfig(USART2, USART_IT_TXE, ENABLE);
-			doread = 1;
-		}
-		interrupt_wait(intr);
-		USART_ITConfig(USART2, USART_IT_TXE, DISABLE);
-	}
-}
+struct mq_attr {
+	long mq_maxmsg;		/* Messages the queue can hold */
+	long mq_msgsize;	/* Largest message */
+};
 
-void serialin(USART_TypeDef* uart, unsigned int intr)
+/* attr is only used with O_CREAT, and may be NULL for PIPE_BUF bytes */
+int mq_open(const char *name, int oflag, const struct mq_attr *attr)
 {
-	int fd;
-	char c;
-	mkfifo("/dev/tty0/in", 0);
-	fd = open("/dev/tty0/in", 0);
-
-    USART_ITConfig(USART2, USART_IT_RXNE, ENABLE);
-
-	while (1) {
-		interrupt_wait(intr);
-		if (USART_GetFlagStatus(uart, USART_FLAG_RXNE) == SET) {
-			c = USART_ReceiveData(uart);
-			write(fd, &c, 1);
+	if (oflag & O_CREAT) {
+		struct pipe_attr pattr = { 0, 0 };
+		if (attr) {
+			/* Each message is stored behind its length */
+			if (attr->mq_maxmsg <= 0 || attr->mq_msgsize <= 0 ||
+			    attr->mq_msgsize > PIPE_POOL_SIZE ||
+			    attr->mq_maxmsg > PIPE_POOL_SIZE)
+				return -1;
+			pattr.atomic = sizeof(size_t) + attr->mq_msgsize;
+			pattr.capacity = attr->mq_maxmsg * pattr.atomic;
 		}
+		mkfile(name, 0, S_IMSGQ, &pattr);
 	}
+	return open(name, 0);
 }
 
 void greeting()
@@ -263,105 +203,82 @@ void greeting()
 void echo()
 {
 	int fdout, fdin;
-	char c;
+	char buf[32];
+	int n;
 	fdout = open("/dev/tty0/out", 0);
 	fdin = open("/dev/tty0/in", 0);
 
 	while (1) {
-		read(fdin, &c, 1);
-		write(fdout, &c, 1);
+		n = read(fdin, buf, sizeof(buf));
+		if (n > 0)
+			write(fdout, buf, n);
 	}
 }
 
 void rs232_xmit_msg_task()
 {
 	int fdout, fdin;
-	char str[100];
-	int curr_char;
 	fdout = open("/dev/tty0/out", 0);
-	fdin = mq_open("/tmp/mqueue/out", O_CREAT);
+	struct mq_attr attr = { 2, 100 };
+	fdin = mq_open("/tmp/mqueue/out", O_CREAT, &attr);
 	setpriority(0, PRIORITY_DEFAULT - 2);
 
 	while (1) {
-		/* Read from the queue.  Keep trying until a message is
-		 * received.  This will block for a period of time (specified
-		 * by portMAX_DELAY). */
-		read(fdin, str, 100);
-
-		/* Write each character of the message to the RS232 port. */
-		curr_char = 0;
-		while (str[curr_char] != '\0') {
-			write(fdout, &str[curr_char], 1);
-			curr_char++;
-		}
+		/* Move each message from the queue to the RS232 port.  This
+		 * blocks until a message is received. */
+		splice(fdin, fdout, attr.mq_msgsize, 0);
 	}
 }
 
-void queue_str_task(const char *str, int delay)
+struct queue_str {
+	const char *str;
+	int delay;
+};
+
+/* Spawned with a struct queue_str as its argument */
+void queue_str_task(void *arg)
 {
-	int fdout = mq_open("/tmp/mqueue/out", 0);
-	int msg_len = strlen(str) + 1;
+	const struct queue_str *qs = arg;
+	int fdout = mq_open("/tmp/mqueue/out", 0, NULL);
+	int msg_len = strlen(qs->str);
 
 	while (1) {
 		/* Post the message.  Keep on trying until it is successful. */
-		write(fdout, str, msg_len);
+		write(fdout, qs->str, msg_len);
 
 		/* Wait. */
-		sleep(delay);
+		sleep(qs->delay);
 	}
 }
 
-void queue_str_task1()
-{
-	queue_str_task("Hello 1\n", 200);
-}
-
-void queue_str_task2()
-{
-	queue_str_task("Hello 2\n", 50);
-}
-
 void serial_readwrite_task()
 {
 	int fdout, fdin;
 	char str[100];
-	char ch;
-	int curr_char;
-	int done;
+	int n;
 
-	fdout = mq_open("/tmp/mqueue/out", 0);
+	fdout = mq_open("/tmp/mqueue/out", 0, NULL);
 	fdin = open("/dev/tty0/in", 0);
 
 	/* Prepare the response message to be queued. */
 	memcpy(str, "Got:", 4);
 
 	while (1) {
-		curr_char = 4;
-		done = 0;
-		do {
-			/* Receive a byte from the RS232 port (this call will
-			 * block). */
-			read(fdin, &ch, 1);
-
-			/* If the byte is an end-of-line type character, then
-			 * finish the string and inidcate we are done.
-			 */
-			if (curr_char >= 98 || (ch == '\r') || (ch == '\n')) {
-				str[curr_char] = '\n';
-				str[curr_char+1] = '\0';
-				done = -1;
-				/* Otherwise, add the character to the
-				 * response string. */
-			}
-			else {
-				str[curr_char++] = ch;
-			}
-		} while (!done);
+		/* Receive a line from the RS232 port (this call will
+		 * block).  The tty hands out at most one line per read. */
+		n = read(fdin, &str[4], sizeof(str) - 4 - 2);
+		if (n <= 0)
+			continue;
+		n += 4;
+
+		/* Finish the string with an end-of-line. */
+		if (str[n - 1] != '\n')
+			str[n++] = '\n';
 
 		/* Once we are done building the response string, queue the
 		 * response to be sent to the RS232 port.
 		 */
-		write(fdout, str, curr_char+1+1);
+		write(fdout, str, n);
 	}
 }
 
@@ -397,57 +314,111 @@ const char tokenlist[TOKEN_COUNT][INPUT_BUFFSIZE] = {"ps","echo","hello"};
 /*******************************************/
 
 
+/*different with the puts in stdio, this puts won't print a '\n' or '\r' in the end of line*/
+void puts(char *s)
+{
+	size_t len = strlen(s);
+	size_t n;
+
+	while (len) {
+		n = len < TTY_OUT_SIZE ? len : TTY_OUT_SIZE;
+		write(STDOUT_FILENO, s, n);
+		s += n;
+		len -= n;
+	}
+}
+
+
 void putchar(const char c)
 {
-	while (USART_GetFlagStatus(USART2, USART_FLAG_TXE) == RESET);
-	USART_SendData(USART2, c);
-	
+	write(STDOUT_FILENO, &c, 1);
 }
 
 
 int getchar(void)
 {
-	int fdin;
 	char c;
-	
-	fdin = open ("/dev/tty0/in", 0);
-	if (fdin == -1) return -1;
 
-	read (fdin, &c, 1);
+	if (read(STDIN_FILENO, &c, 1) != 1) return -1;
 	return c;
 }
 
 
+/*the tty echoes and edits the line, so this is a single read*/
 char *gets (char *buff)
 {
-	int i = 0;
-	char c = 0;
+	int n;
 
-	while (c != 13 && i < INPUT_BUFFSIZE)
-	{
-		c = getchar ();
-		if (c < 0) return NULL;
-		if (c == 127)	/*type in 'backspace'*/
-		{
-			i--;
-			if (i < 0) i = 0;
-			putchar ('\b');
-			putchar (' ');
-			putchar ('\b');
-			continue;
-		}
-		putchar (c); /*echo user input*/
-		buff[i] = c;
-		i++;
-	}
-	i--;
-	buff[i] = '\0';
-	putchar ('\r');
-	putchar ('\n');
+	n = read(STDIN_FILENO, buff, INPUT_BUFFSIZE - 1);
+	if (n <= 0) return NULL;
+	if (buff[n - 1] == '\n') n--;
+	buff[n] = '\0';
 
 	return buff;
 }
 
+/*single producer, single consumer ring in shared memory: each side only
+ *traps to sleep on the other's index, or to wake the other side when it
+ *says it is asleep*/
+void ring_init (struct ring *ring, void *data, unsigned int size)
+{
+	ring->head = 0;
+	ring->tail = 0;
+	ring->size = size;
+	ring->data = data;
+	ring->reader_waits = 0;
+	ring->writer_waits = 0;
+}
+
+
+int ring_write (struct ring *ring, const void *buf, unsigned int len)
+{
+	const unsigned char *src = buf;
+	unsigned int head = ring->head;
+	unsigned int tail;
+	unsigned int n;
+
+	while ((tail = ring->tail) + ring->size == head) {
+		ring->writer_waits = 1;
+		__DMB();
+		futex_wait((unsigned int *)&ring->tail, tail, -1);
+		ring->writer_waits = 0;
+	}
+	for (n = 0; n < len && head - tail < ring->size; n++, head++)
+		ring->data[head & (ring->size - 1)] = src[n];
+	__DMB();
+	ring->head = head;
+	__DMB();
+	if (ring->reader_waits)
+		futex_wake((unsigned int *)&ring->head, 1);
+	return n;
+}
+
+
+int ring_read (struct ring *ring, void *buf, unsigned int len)
+{
+	unsigned char *dst = buf;
+	unsigned int tail = ring->tail;
+	unsigned int head;
+	unsigned int n;
+
+	while ((head = ring->head) == tail) {
+		ring->reader_waits = 1;
+		__DMB();
+		futex_wait((unsigned int *)&ring->head, head, -1);
+		ring->reader_waits = 0;
+	}
+	__DMB();
+	for (n = 0; n < len && tail != head; n++, tail++)
+		dst[n] = ring->data[tail & (ring->size - 1)];
+	__DMB();
+	ring->tail = tail;
+	__DMB();
+	if (ring->writer_waits)
+		futex_wake((unsigned int *)&ring->tail, 1);
+	return n;
+}
+
 
 /*make the user input tokenization
  *char *buff is to store the user input
@@ -531,13 +502,17 @@ char *itoa (int number, char *string)
  */
 void ps_cmd (void)
 {
-	char statuslist[5][10] = {"ready","w_read","w_write","w_inir","w_time"};
+	char statuslist[16][10] = {"ready","w_read","w_write","w_inir","w_time","w_poll",
+	                           "w_send","w_reply","w_retry","w_event","w_notify",
+	                           "w_mutex","w_sem","w_futex","zombie","w_child"};
 	char string[32];
 	int i = 0;
 
 	puts ("PID\tSTATUS\t\tPRIORITY\t\r\n");
 	for (i = 0; i < task_count; i++)
 	{
+		if (tasks[i].status == TASK_FREE)
+			continue;
 		puts ( itoa (tasks[i].pid, string) );
 		puts ("\t");
 		puts (statuslist[tasks[i].status]);
@@ -674,62 +649,124 @@ void shell (void)
 }
 
 
+void idle()
+{
+	while (1)
+		__WFI();	/* Sleep until the next interrupt */
+}
+
+/*a spawned task that returns from its entry function ends up here*/
+void task_return()
+{
+	exit(0);
+}
+
 void first()
 {
-	setpriority(0, 0);
+	spawn(rs232_xmit_msg_task, NULL, 0, PRIORITY_DEFAULT);
 
-	if (!fork()) setpriority(0, 0), pathserver();
-	if (!fork()) setpriority(0, 0), serialout(USART2, USART2_IRQn);
-	if (!fork()) setpriority(0, 0), serialin(USART2, USART2_IRQn);
-	if (!fork()) rs232_xmit_msg_task();
-	
-	if (!fork()) setpriority(0, 0), shell();	/*start shell*/
+	spawn(shell, NULL, 0, 0);	/*start shell*/
 
 	setpriority(0, PRIORITY_LIMIT);
 
-	while(1);
+	idle();
 }
 
+/* Ring buffer with free-running start/end counters: the fill level is
+ * end - start, and indices wrap by masking since size is a power of two.
+ * All size bytes are usable. */
 struct pipe_ringbuffer {
-	int start;
-	int end;
-	char data[PIPE_BUF];
+	unsigned int start;
+	unsigned int end;
+	char *data;	/* Storage from pipe_pool */
+	size_t size;	/* Capacity, a power of two */
+	size_t atomic;	/* Largest write or message, at most size */
+	size_t lowat;	/* Bytes a FIFO read waits for */
+	struct task_list readers;	/* Tasks blocked in read, by priority */
+	struct task_list writers;	/* Tasks blocked in write, by priority */
+	int refs;	/* Open fds and names referring to the pipe */
+	int irq;	/* Interrupt delivered into an S_IFIRQ pipe, else -1 */
+	unsigned int exti;	/* S_IFIRQ: EXTI lines acknowledged per event */
+	int dev;	/* S_IFIFO, S_IMSGQ, S_IFIRQ, S_IFCHAN or S_IBUFQ */
+	struct task_control_block *owner;	/* S_IFCHAN: last task to receive */
+	unsigned int pollers;	/* Bit i set: tasks[i] may be polling it */
+	struct pipe_ringbuffer *next;	/* On pipe_free while unused */
 
 	int (*readable) (struct pipe_ringbuffer*, struct task_control_block*);
 	int (*writable) (struct pipe_ringbuffer*, struct task_control_block*);
 	int (*read) (struct pipe_ringbuffer*, struct task_control_block*);
 	int (*write) (struct pipe_ringbuffer*, struct task_control_block*);
+	void (*kick) (struct pipe_ringbuffer*);	/* Data pushed outside write */
 };
 
-#define RB_PUSH(rb, size, v) do { \
-		(rb).data[(rb).end] = (v); \
-		(rb).end++; \
-		if ((rb).end >= size) (rb).end = 0; \
-	} while (0)
-
-#define RB_POP(rb, size, v) do { \
-		(v) = (rb).data[(rb).start]; \
-		(rb).start++; \
-		if ((rb).start >= size) (rb).start = 0; \
-	} while (0)
-
-#define RB_PEEK(rb, size, v, i) do { \
-		int _counter = (i); \
-		int _src_index = (rb).start; \
-		int _dst_index = 0; \
-		while (_counter--) { \
-			((char*)&(v))[_dst_index++] = (rb).data[_src_index++]; \
-			if (_src_index >= size) _src_index = 0; \
-		} \
-	} while (0)
-
-#define RB_LEN(rb, size) (((rb).end - (rb).start) + \
-	(((rb).end < (rb).start) ? size : 0))
-
-#define PIPE_PUSH(pipe, v) RB_PUSH((pipe), PIPE_BUF, (v))
-#define PIPE_POP(pipe, v)  RB_POP((pipe), PIPE_BUF, (v))
-#define PIPE_PEEK(pipe, v, i)  RB_PEEK((pipe), PIPE_BUF, (v), (i))
-#define PIPE_LEN(pipe)     (RB_LEN((pipe), PIPE_BUF))
+#define PIPE_LEN(pipe) ((pipe).end - (pipe).start)
+
+#if PIPE_LIMIT > 255
+#error "fds[] holds pipe indices in an unsigned char"
+#endif
+#if TASK_LIMIT > 32
+#error "pipe->pollers holds one bit per task"
+#endif
+#if FD_LIMIT > 32
+#error "fd_nonblock holds one bit per fd"
+#endif
+
+#define MSGBUF_LIMIT (PIPE_POOL_SIZE / MSGBUF_SIZE)
+#if MSGBUF_LIMIT > 32
+#error "msgbuf_map holds one bit per message buffer"
+#endif
+
+#define PIPE_WAITERS(pipe) \
+	((pipe)->readers.head || (pipe)->writers.head || (pipe)->pollers)
+
+/*Global variables: pipes*/
+struct pipe_ringbuffer pipes[PIPE_LIMIT];
+struct pipe_ringbuffer *pipe_free = NULL;
+char pipe_pool[PIPE_POOL_SIZE] __attribute__ ((aligned (4)));
+size_t pipe_pool_used = 0;
+void *pipe_pool_free[16];	/* Freed storage, indexed by log2 of its size */
+size_t msgbuf_count = 0;	/* Message buffers carved off the top of pipe_pool */
+unsigned int msgbuf_map;	/* Bit 31 - i set: message buffer i is allocated */
+
+/* Ring transfers are at most two memcpy calls: up to the end of data[],
+ * then the wrapped remainder from its start */
+void
+pipe_peek (struct pipe_ringbuffer *pipe, void *buf, size_t n)
+{
+	size_t offset = pipe->start & (pipe->size - 1);
+	size_t first = pipe->size - offset;
+
+	if (first >= n) {
+		memcpy(buf, pipe->data + offset, n);
+	}
+	else {
+		memcpy(buf, pipe->data + offset, first);
+		memcpy((char*)buf + first, pipe->data, n - first);
+	}
+}
+
+void
+pipe_pop (struct pipe_ringbuffer *pipe, void *buf, size_t n)
+{
+	pipe_peek(pipe, buf, n);
+	pipe->start += n;
+}
+
+void
+pipe_push (struct pipe_ringbuffer *pipe, const void *buf, size_t n)
+{
+	size_t offset = pipe->end & (pipe->size - 1);
+	size_t first = pipe->size - offset;
+
+	if (first >= n) {
+		memcpy(pipe->data + offset, buf, n);
+	}
+	else {
+		memcpy(pipe->data + offset, buf, first);
+		memcpy(pipe->data, (const char*)buf + first, n - first);
+	}
+	pipe->end += n;
+}
 
 unsigned int *init_task(unsigned int *stack, void (*start)())
 {
@@ -738,102 +775,468 @@ unsigned int *init_task(unsigned int *stack, void (*start)())
 	return stack;
 }
 
+/* Initial frame for a task started from the kernel: the exception return
+ * enters start(arg), and start returns to task_return */
+struct user_thread_stack *
+init_frame (unsigned int *stack, void (*start)(), void *arg)
+{
+	struct user_thread_stack *frame;
+
+	/* Only the registers, up to xpsr, sit at the end of the stack */
+	frame = (void *)(stack + STACK_SIZE -
+	                 offsetof(struct user_thread_stack, stack) / sizeof(*stack));
+	frame->r7 = 0;
+	frame->_r7 = 0;
+	frame->_lr = 0xfffffffd;	/* Thread mode, process stack */
+	frame->r0 = (unsigned int)arg;
+	frame->lr = (unsigned int)&task_return;
+	frame->pc = (unsigned int)start & ~1u;	/* Thumb state is in xpsr */
+	frame->xpsr = 0x01000000;	/* Thumb */
+	return frame;
+}
+
+void
+task_list_init (struct task_list *list)
+{
+	list->head = NULL;
+	list->tail = &list->head;
+}
+
+void
+task_remove (struct task_control_block *item)
+{
+	if (item->list) {
+		if (item->next)
+			item->next->prev = item->prev;
+		else
+			item->list->tail = item->prev;
+		*(item->prev) = item->next;
+		item->prev = NULL;
+		item->next = NULL;
+		item->list = NULL;
+	}
+}
+
 int
-task_push (struct task_control_block **list, struct task_control_block *item)
+task_push (struct task_list *list, struct task_control_block *item)
 {
 	if (list && item) {
 		/* Remove itself from original list */
-		if (item->prev)
-			*(item->prev) = item->next;
-		if (item->next)
-			item->next->prev = item->prev;
+		task_remove(item);
 		/* Insert into new list */
-		while (*list) list = &((*list)->next);
-		*list = item;
-		item->prev = list;
+		*(list->tail) = item;
+		item->prev = list->tail;
 		item->next = NULL;
+		item->list = list;
+		list->tail = &item->next;
+		return 0;
+	}
+	return -1;
+}
+
+/* Insert behind all tasks of the same or higher priority */
+int
+task_insert (struct task_list *list, struct task_control_block *item)
+{
+	if (list && item) {
+		struct task_control_block **link = &list->head;
+
+		task_remove(item);
+		while (*link && (*link)->priority <= item->priority)
+			link = &((*link)->next);
+		item->prev = link;
+		item->next = *link;
+		item->list = list;
+		if (*link)
+			(*link)->prev = &item->next;
+		else
+			list->tail = &item->next;
+		*link = item;
 		return 0;
 	}
 	return -1;
 }
 
 struct task_control_block*
-task_pop (struct task_control_block **list)
+task_pop (struct task_list *list)
 {
 	if (list) {
-		struct task_control_block *item = *list;
+		struct task_control_block *item = list->head;
 		if (item) {
-			*list = item->next;
-			if (item->next)
-				item->next->prev = list;
-			item->prev = NULL;
-			item->next = NULL;
+			task_remove(item);
 			return item;
 		}
 	}
 	return NULL;
 }
 
-void _read(struct task_control_block *task, struct task_control_block *tasks, size_t task_count, struct pipe_ringbuffer *pipes);
-void _write(struct task_control_block *task, struct task_control_block *tasks, size_t task_count, struct pipe_ringbuffer *pipes);
+/* Count leading zeros, a single instruction on Cortex-M3 */
+static inline unsigned int clz(unsigned int x)
+{
+	unsigned int n;
+	asm("clz %0, %1" : "=r" (n) : "r" (x));
+	return n;
+}
+
+#define READY_BIT(priority) (0x80000000U >> ((priority) & 31))
+
+void
+ready_push (struct task_control_block *task)
+{
+	task_push(&ready_list[task->priority], task);
+	ready_bitmap[task->priority >> 5] |= READY_BIT(task->priority);
+}
+
+/* Returns the highest priority with a ready task,
+ * or a value above PRIORITY_LIMIT if there is none */
+int
+ready_highest (void)
+{
+	int i;
+	for (i = 0; i < READY_BITMAP_WORDS; i++)
+		if (ready_bitmap[i])
+			return (i << 5) + clz(ready_bitmap[i]);
+	return READY_BITMAP_WORDS << 5;
+}
+
+/* Timer list: sleeping tasks sorted by wakeup tick.  Ticks are compared
+ * by their signed difference, so the order survives tick_count wrapping
+ * as long as no sleep is longer than 2^31 ticks. */
+struct task_control_block *timer_list = NULL;
+unsigned int tick_count = 0;
+
+#define TICK_BEFORE(a, b) ((int)((a) - (b)) < 0)
+
+void
+timer_remove (struct task_control_block *task)
+{
+	if (task->timer_prev) {
+		if (task->timer_next)
+			task->timer_next->timer_prev = task->timer_prev;
+		*(task->timer_prev) = task->timer_next;
+		task->timer_prev = NULL;
+		task->timer_next = NULL;
+	}
+}
+
+void
+timer_insert (struct task_control_block *task, unsigned int wakeup)
+{
+	struct task_control_block **link = &timer_list;
+
+	timer_remove(task);
+	task->wakeup = wakeup;
+	while (*link && !TICK_BEFORE(wakeup, (*link)->wakeup))
+		link = &((*link)->timer_next);
+	task->timer_prev = link;
+	task->timer_next = *link;
+	if (*link)
+		(*link)->timer_prev = &task->timer_next;
+	*link = task;
+}
+
+/* End a read, write or interrupt wait that ran out of time */
+void
+timer_timeout (struct task_control_block *task)
+{
+	task_remove(task);
+	task->stack->r0 = -ETIMEDOUT;
+	task->status = TASK_READY;
+}
+
+/* Bound the wait task has just entered by ticks, negative for none.
+ * Zero fails at once if the call would block. */
+void
+timer_bound (struct task_control_block *task, int ticks)
+{
+	if (task->status == TASK_READY || ticks < 0)
+		return;
+	if (ticks == 0)
+		timer_timeout(task);
+	else
+		timer_insert(task, tick_count + ticks);
+}
+
+/* Wake every task whose wakeup tick has been reached.  Only the expired
+ * head of the list is touched, whatever the number of sleepers. */
+void
+timer_expire (unsigned int now)
+{
+	struct task_control_block *task;
+
+	while ((task = timer_list) != NULL &&
+	       !TICK_BEFORE(now, task->wakeup)) {
+		timer_remove(task);
+		if (task->status == TASK_WAIT_READ ||
+		    task->status == TASK_WAIT_WRITE ||
+		    task->status == TASK_WAIT_INTR ||
+		    task->status == TASK_WAIT_EVENT ||
+		    task->status == TASK_WAIT_NOTIFY ||
+		    task->status == TASK_WAIT_FUTEX)
+			timer_timeout(task);
+		task->status = TASK_READY;
+		ready_push(task);
+	}
+}
+
+#if configUSE_TICKLESS_IDLE
+/* Tickless mode: while only the idle task at PRIORITY_LIMIT can run, the
+ * tick is only needed for the next sleep deadline.  SysTick is stretched up
+ * to that deadline and tick_count is corrected on the next kernel entry. */
+#define TICK_PERIOD (configCPU_CLOCK_HZ / configTICK_RATE_HZ)
+#define TICKLESS_MAX (SysTick_LOAD_RELOAD_Msk / TICK_PERIOD)
+
+unsigned int tickless_ticks = 0;	/* Length of stretched period, 0 if ticking */
+unsigned int tickless_phase;	/* Cycles from last tick to start of stretch */
+
+void
+tickless_enter (unsigned int ticks)
+{
+	unsigned int remaining;
+
+	if (ticks > TICKLESS_MAX)
+		ticks = TICKLESS_MAX;
+	if (ticks < 2)
+		return;
+
+	SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
+	remaining = SysTick->VAL;
+	tickless_phase = TICK_PERIOD - remaining;
+	SysTick->LOAD = remaining + (ticks - 1) * TICK_PERIOD - 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+	tickless_ticks = ticks;
+}
+
+/* Returns the number of ticks that passed unseen while stretched */
+unsigned int
+tickless_exit (void)
+{
+	unsigned int ctrl;
+	unsigned int elapsed;
+	unsigned int ticks;
+
+	if (!tickless_ticks)
+		return 0;
+
+	ctrl = SysTick->CTRL;
+	SysTick->CTRL = ctrl & ~SysTick_CTRL_ENABLE_Msk;
+	ctrl |= SysTick->CTRL;	/* Catch a wrap racing with the disable */
+
+	if (ctrl & SysTick_CTRL_COUNTFLAG_Msk) {
+		/* Ran to the deadline, the SysTick exception counts the last tick */
+		ticks = tickless_ticks - 1;
+		elapsed = TICK_PERIOD;
+	}
+	else {
+		elapsed = tickless_phase + SysTick->LOAD - SysTick->VAL;
+		ticks = elapsed / TICK_PERIOD;
+		elapsed = TICK_PERIOD - elapsed % TICK_PERIOD;
+	}
+
+	/* Resume periodic ticks, keeping the phase of the next one */
+	SysTick->LOAD = (elapsed > 1) ? elapsed - 1 : 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL = ctrl | SysTick_CTRL_ENABLE_Msk;
+	SysTick->LOAD = TICK_PERIOD - 1;
+
+	tickless_ticks = 0;
+	return ticks;
+}
+#endif
+
+/* The current tick, for interrupt handlers that run outside the kernel
+ * while tick_count may be behind a stretched tick.  Reading CTRL would
+ * clear COUNTFLAG under tickless_exit, so a run to the deadline shows as
+ * the SysTick exception pending instead. */
+unsigned int
+tick_now (void)
+{
+#if configUSE_TICKLESS_IDLE
+	if (!tickless_ticks)
+		return tick_count;
+	if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)
+		return tick_count + tickless_ticks;
+	return tick_count +
+	       (tickless_phase + SysTick->LOAD - SysTick->VAL) / TICK_PERIOD;
+#else
+	return tick_count;
+#endif
+}
+
+struct task_control_block*
+ready_pop (void)
+{
+	int priority = ready_highest();
+	struct task_control_block *task;
+
+	if (priority > PRIORITY_LIMIT)
+		return NULL;
+	task = task_pop(&ready_list[priority]);
+	if (!ready_list[priority].head)
+		ready_bitmap[priority >> 5] &= ~READY_BIT(priority);
+	return task;
+}
+
+/* Change the priority of a task, keeping it in order on the ready list
+ * or wait queue it is on */
+void
+task_set_priority (struct task_control_block *task, int priority)
+{
+	struct task_list *list = task->list;
+
+	if (list >= ready_list && list <= &ready_list[PRIORITY_LIMIT]) {
+		task_remove(task);
+		if (!list->head)
+			ready_bitmap[task->priority >> 5] &= ~READY_BIT(task->priority);
+		task->priority = priority;
+		ready_push(task);
+	}
+	else {
+		task->priority = priority;
+		if (list)
+			task_insert(list, task);
+	}
+}
+
+/* Priority inheritance: a task runs at the highest priority of its own
+ * and of every task blocked on it, and passes that on down the chain of
+ * tasks it is itself blocked on.  Call after waits_for changes. */
+void
+task_reprioritize (struct task_control_block *task)
+{
+	int priority;
+	size_t i;
+
+	while (task) {
+		priority = task->base_priority;
+		for (i = 0; i < task_count; i++)
+			if (tasks[i].waits_for == task && tasks[i].priority < priority)
+				priority = tasks[i].priority;
+		if (priority == task->priority)
+			break;
+		task_set_priority(task, priority);
+		task = task->waits_for;
+	}
+}
+
+void poll_wake(struct pipe_ringbuffer *pipe);
+
+/* Retry the highest priority reader and writer blocked on the pipe until
+ * neither can make progress.  Each completed transfer may unblock the
+ * other side, so loop here instead of recursing between _read/_write. */
+void pipe_wake(struct pipe_ringbuffer *pipe)
+{
+	struct task_control_block *task;
+	int progress;
+
+	do {
+		progress = 0;
+		if ((task = pipe->readers.head) != NULL) {
+			task->status = TASK_READY;
+			if (pipe->readable(pipe, task))
+				task->stack->r0 = pipe->read(pipe, task);
+			if (task->status == TASK_READY) {
+				timer_remove(task);
+				ready_push(task);
+				progress = 1;
+			}
+		}
+		if ((task = pipe->writers.head) != NULL) {
+			task->status = TASK_READY;
+			if (pipe->writable(pipe, task))
+				task->stack->r0 = pipe->write(pipe, task);
+			if (task->status == TASK_READY) {
+				timer_remove(task);
+				ready_push(task);
+				progress = 1;
+			}
+		}
+	} while (progress);
+
+	if (pipe->pollers)
+		poll_wake(pipe);
+}
+
+/* Returns the pipe open as fd in task, or NULL */
+struct pipe_ringbuffer *
+fd_pipe (struct task_control_block *task, unsigned int fd)
+{
+	if (fd >= FD_LIMIT || !task->fds[fd])
+		return NULL;
+	return &pipes[task->fds[fd] - 1];
+}
+
+/* Called when a call on fd has to wait.  For an O_NONBLOCK fd this fails
+ * the call with -EAGAIN instead and returns nonzero. */
+int
+fd_wouldblock (struct task_control_block *task, unsigned int fd)
+{
+	if (!(task->fd_nonblock & (1 << fd)))
+		return 0;
+	task->status = TASK_READY;
+	task->stack->r0 = -EAGAIN;
+	return 1;
+}
 
-void _read(struct task_control_block *task, struct task_control_block *tasks, size_t task_count, struct pipe_ringbuffer *pipes)
+void _read(struct task_control_block *task)
 {
+	struct pipe_ringbuffer *pipe = fd_pipe(task, task->stack->r0);
+
 	task->status = TASK_READY;
 	/* If the fd is invalid */
-	if (task->stack->r0 > PIPE_LIMIT) {
+	if (!pipe) {
 		task->stack->r0 = -1;
 	}
 	else {
-		struct pipe_ringbuffer *pipe = &pipes[task->stack->r0];
-
 		if (pipe->readable(pipe, task)) {
-			size_t i;
-
-			pipe->read(pipe, task);
+			task->stack->r0 = pipe->read(pipe, task);
 
 			/* Unblock any waiting writes */
-			for (i = 0; i < task_count; i++)
-				if (tasks[i].status == TASK_WAIT_WRITE)
-					_write(&tasks[i], tasks, task_count, pipes);
+			pipe_wake(pipe);
+		}
+		else if (task->status == TASK_WAIT_READ) {
+			if (fd_wouldblock(task, task->stack->r0))
+				return;
+			task_insert(&pipe->readers, task);
 		}
 	}
 }
 
-void _write(struct task_control_block *task, struct task_control_block *tasks, size_t task_count, struct pipe_ringbuffer *pipes)
+void _write(struct task_control_block *task)
 {
+	struct pipe_ringbuffer *pipe = fd_pipe(task, task->stack->r0);
+
 	task->status = TASK_READY;
 	/* If the fd is invalid */
-	if (task->stack->r0 > PIPE_LIMIT) {
+	if (!pipe) {
 		task->stack->r0 = -1;
 	}
 	else {
-		struct pipe_ringbuffer *pipe = &pipes[task->stack->r0];
-
 		if (pipe->writable(pipe, task)) {
-			size_t i;
-
-			pipe->write(pipe, task);
+			task->stack->r0 = pipe->write(pipe, task);
 
 			/* Unblock any waiting reads */
-			for (i = 0; i < task_count; i++)
-				if (tasks[i].status == TASK_WAIT_READ)
-					_read(&tasks[i], tasks, task_count, pipes);
+			pipe_wake(pipe);
+		}
+		else if (task->status == TASK_WAIT_WRITE) {
+			if (fd_wouldblock(task, task->stack->r0))
+				return;
+			task_insert(&pipe->writers, task);
 		}
 	}
 }
 
+/* FIFO reads are partial: they wait for the low watermark, or for the
+ * whole request if that is smaller, and then return what is there */
 int
 fifo_readable (struct pipe_ringbuffer *pipe,
 			   struct task_control_block *task)
 {
-	/* Trying to read too much */
-	if (task->stack->r2 > PIPE_BUF) {
-		task->stack->r0 = -1;
-		return 0;
-	}
-	if ((size_t)PIPE_LEN(*pipe) < task->stack->r2) {
-		/* Trying to read more than there is: block */
+	size_t want = task->stack->r2 < pipe->lowat ? task->stack->r2
+	                                             : pipe->lowat;
+
+	if ((size_t)PIPE_LEN(*pipe) < want) {
 		task->status = TASK_WAIT_READ;
 		return 0;
 	}
@@ -853,7 +1256,7 @@ mq_readable (struct pipe_ringbuffer *pipe,
 		return 0;
 	}
 
-	PIPE_PEEK(*pipe, msg_len, 4);
+	pipe_peek(pipe, &msg_len, sizeof(size_t));
 
 	if (msg_len > task->stack->r2) {
 		/* Trying to read more than buffer size */
@@ -867,13 +1270,13 @@ int
 fifo_read (struct pipe_ringbuffer *pipe,
 		   struct task_control_block *task)
 {
-	size_t i;
-	char *buf = (char*)task->stack->r1;
+	size_t n = PIPE_LEN(*pipe);
+
+	if (n > task->stack->r2)
+		n = task->stack->r2;
 	/* Copy data into buf */
-	for (i = 0; i < task->stack->r2; i++) {
-		PIPE_POP(*pipe, buf[i]);
-	}
-	return task->stack->r2;
+	pipe_pop(pipe, (char*)task->stack->r1, n);
+	return n;
 }
 
 int
@@ -881,31 +1284,23 @@ mq_read (struct pipe_ringbuffer *pipe,
 		 struct task_control_block *task)
 {
 	size_t msg_len;
-	size_t i;
-	char *buf = (char*)task->stack->r1;
 	/* Get length */
-	for (i = 0; i < 4; i++) {
-		PIPE_POP(*pipe, *(((char*)&msg_len)+i));
-	}
+	pipe_pop(pipe, &msg_len, sizeof(size_t));
 	/* Copy data into buf */
-	for (i = 0; i < msg_len; i++) {
-		PIPE_POP(*pipe, buf[i]);
-	}
+	pipe_pop(pipe, (char*)task->stack->r1, msg_len);
 	return msg_len;
 }
 
+/* Writes of up to atomic bytes go in whole.  Longer ones wait for that
+ * much room and then write what fits, returning a short count. */
 int
 fifo_writable (struct pipe_ringbuffer *pipe,
 			   struct task_control_block *task)
 {
-	/* If the write would be non-atomic */
-	if (task->stack->r2 > PIPE_BUF) {
-		task->stack->r0 = -1;
-		return 0;
-	}
-	/* Preserve 1 byte to distiguish empty or full */
-	if ((size_t)PIPE_BUF - PIPE_LEN(*pipe) - 1 < task->stack->r2) {
-		/* Trying to write more than we have space for: block */
+	size_t want = task->stack->r2 < pipe->atomic ? task->stack->r2
+	                                              : pipe->atomic;
+
+	if (pipe->size - PIPE_LEN(*pipe) < want) {
 		task->status = TASK_WAIT_WRITE;
 		return 0;
 	}
@@ -919,12 +1314,11 @@ mq_writable (struct pipe_ringbuffer *pipe,
 	size_t total_len = sizeof(size_t) + task->stack->r2;
 
 	/* If the write would be non-atomic */
-	if (total_len > PIPE_BUF) {
+	if (total_len > pipe->atomic) {
 		task->stack->r0 = -1;
 		return 0;
 	}
-	/* Preserve 1 byte to distiguish empty or full */
-	if ((size_t)PIPE_BUF - PIPE_LEN(*pipe) - 1 < total_len) {
+	if (pipe->size - PIPE_LEN(*pipe) < total_len) {
 		/* Trying to write more than we have space for: block */
 		task->status = TASK_WAIT_WRITE;
 		return 0;
@@ -936,32 +1330,416 @@ int
 fifo_write (struct pipe_ringbuffer *pipe,
 			struct task_control_block *task)
 {
-	size_t i;
-	const char *buf = (const char*)task->stack->r1;
+	size_t n = pipe->size - PIPE_LEN(*pipe);
+
+	if (n > task->stack->r2)
+		n = task->stack->r2;
 	/* Copy data into pipe */
-	for (i = 0; i < task->stack->r2; i++)
-		PIPE_PUSH(*pipe,buf[i]);
-	return task->stack->r2;
+	pipe_push(pipe, (const char*)task->stack->r1, n);
+	return n;
 }
 
 int
 mq_write (struct pipe_ringbuffer *pipe,
 		  struct task_control_block *task)
 {
-	size_t i;
-	const char *buf = (const char*)task->stack->r1;
 	/* Copy count into pipe */
-	for (i = 0; i < sizeof(size_t); i++)
-		PIPE_PUSH(*pipe,*(((char*)&task->stack->r2)+i));
+	pipe_push(pipe, &task->stack->r2, sizeof(size_t));
 	/* Copy data into pipe */
-	for (i = 0; i < task->stack->r2; i++)
-		PIPE_PUSH(*pipe,buf[i]);
+	pipe_push(pipe, (const char*)task->stack->r1, task->stack->r2);
 	return task->stack->r2;
 }
 
+/* Device interrupt handlers registered with irq_register run straight
+ * from the vector, ahead of the kernel.  They feed pipes through the
+ * pipe_isr_* calls below, which only ever advance pipe->end, so each pipe
+ * takes a single interrupt-side producer.  Readers woken by them are left
+ * in pipe_pending and woken by one kernel entry once the handler is done. */
+void (*irq_handlers[IRQ_LIMIT]) (unsigned int irq);
+unsigned int pipe_pending;	/* Bit 31 - i set: pipes[i] has tasks to wake */
+unsigned int event_pending;	/* Likewise for event groups */
+unsigned int notify_pending;	/* Likewise for tasks waiting for notifications */
+
+#if PIPE_LIMIT > 32
+#error "pipe_pending holds one bit per pipe"
+#endif
+
+/* Mark the pipe for a wake pass if anyone is blocked on it */
+void
+pipe_isr_wake (struct pipe_ringbuffer *pipe)
+{
+	if (PIPE_WAITERS(pipe))
+		pipe_pending |= 0x80000000 >> (pipe - pipes);
+}
+
+/* Push n bytes into a FIFO, all or nothing.  Returns n, or -1 if they do
+ * not fit. */
+int
+pipe_isr_write (struct pipe_ringbuffer *pipe, const void *buf, size_t n)
+{
+	if (pipe->size - PIPE_LEN(*pipe) < n)
+		return -1;
+	pipe_push(pipe, buf, n);
+	pipe_isr_wake(pipe);
+	return n;
+}
+
+/* Queue one message on a message queue, in the layout mq_read expects */
+int
+pipe_isr_send (struct pipe_ringbuffer *pipe, const void *msg, size_t n)
+{
+	if (sizeof(size_t) + n > pipe->atomic ||
+	    pipe->size - PIPE_LEN(*pipe) < sizeof(size_t) + n)
+		return -1;
+	pipe_push(pipe, &n, sizeof(size_t));
+	pipe_push(pipe, msg, n);
+	pipe_isr_wake(pipe);
+	return n;
+}
+
+/* Route a device interrupt to handler.  Handlers share the kernel's
+ * priority, so they never run while the kernel is touching a pipe. */
+void
+irq_register (IRQn_Type irq, void (*handler) (unsigned int irq))
+{
+	irq_handlers[irq] = handler;
+	NVIC_SetPriority(irq, 0);
+	NVIC_EnableIRQ(irq);
+}
+
+void
+irq_unregister (IRQn_Type irq)
+{
+	NVIC_DisableIRQ(irq);
+	irq_handlers[irq] = NULL;
+}
+
+/* Called by the interrupt vector with the device IRQ number.  Returns
+ * nonzero if the kernel has to be entered: to wake readers, or to hand an
+ * unregistered interrupt to tasks in interrupt_wait. */
+int
+irq_dispatch (unsigned int irq)
+{
+	if (irq >= IRQ_LIMIT || !irq_handlers[irq])
+		return 1;
+	irq_handlers[irq](irq);
+	return pipe_pending || event_pending || notify_pending;
+}
+
+/* Run the wake passes left by interrupt handlers */
+void
+pipe_wake_pending (void)
+{
+	unsigned int i;
+
+	while (pipe_pending) {
+		i = clz(pipe_pending);
+		pipe_pending &= ~(0x80000000 >> i);
+		pipe_wake(&pipes[i]);
+	}
+}
+
+/* Shared by ops a device does not support */
+int
+pipe_badop (struct pipe_ringbuffer *pipe, struct task_control_block *task)
+{
+	task->stack->r0 = -1;
+	return 0;
+}
+
+/* S_IFIRQ pipes turn a device interrupt into readable events.  Without
+ * IRQ_TIMESTAMP nothing is stored: end - start counts the events, and a
+ * read collects the count.  With it each event queues the tick it arrived
+ * on.  Peripheral interrupts are level-sensitive, so an event is only
+ * counted once if the handler acknowledges it: pipes given EXTI lines have
+ * them cleared here and stay enabled until the queue is full.  Any other
+ * source is masked on each event, and a read re-enables it once the
+ * reader has cleared the source, so those see at most one event a read. */
+unsigned char irq_pipe[IRQ_LIMIT];	/* Pipe index for irq_event */
+
+int irq_count_read (struct pipe_ringbuffer *pipe,
+                    struct task_control_block *task);
+
+void
+irq_event (unsigned int irq)
+{
+	struct pipe_ringbuffer *pipe = &pipes[irq_pipe[irq]];
+	unsigned int tick;
+
+	if (pipe->exti)
+		EXTI->PR = pipe->exti;
+	if (pipe->read == irq_count_read) {
+		pipe->end++;
+	}
+	else {
+		tick = tick_now();
+		pipe_push(pipe, &tick, sizeof(tick));
+	}
+	if (!pipe->exti || PIPE_LEN(*pipe) == pipe->size)
+		NVIC_DisableIRQ(irq);
+	pipe_isr_wake(pipe);
+}
+
+int
+irq_readable (struct pipe_ringbuffer *pipe,
+			  struct task_control_block *task)
+{
+	if (task->stack->r2 < sizeof(unsigned int)) {
+		task->stack->r0 = -1;
+		return 0;
+	}
+	if (!PIPE_LEN(*pipe)) {
+		task->status = TASK_WAIT_READ;
+		return 0;
+	}
+	return 1;
+}
+
+/* Reads the number of events since the last read */
+int
+irq_count_read (struct pipe_ringbuffer *pipe,
+				struct task_control_block *task)
+{
+	unsigned int count = PIPE_LEN(*pipe);
+
+	pipe->start += count;
+	*(unsigned int *)task->stack->r1 = count;
+	NVIC_EnableIRQ(pipe->irq);
+	return sizeof(count);
+}
+
+/* Reads as many queued timestamps as fit */
+int
+irq_stamp_read (struct pipe_ringbuffer *pipe,
+				struct task_control_block *task)
+{
+	size_t n = task->stack->r2 & ~(sizeof(unsigned int) - 1);
+
+	if (n > PIPE_LEN(*pipe))
+		n = PIPE_LEN(*pipe);
+	pipe_pop(pipe, (char*)task->stack->r1, n);
+	NVIC_EnableIRQ(pipe->irq);
+	return n;
+}
+
+/* Ring storage comes in power-of-two blocks.  Freed blocks are kept on a
+ * free list per size, linked through their first word, and reused before
+ * more of pipe_pool is carved off. */
+void *
+pool_alloc (size_t size)
+{
+	unsigned int order = 31 - clz(size);
+	void **list = &pipe_pool_free[order];
+	void *block;
+
+	if (!size || order >= sizeof(pipe_pool_free) / sizeof(pipe_pool_free[0]))
+		return NULL;
+	block = *list;
+	if (block) {
+		*list = *(void **)block;
+	}
+	else if (size <= PIPE_POOL_SIZE - msgbuf_count * MSGBUF_SIZE -
+	                 pipe_pool_used) {
+		block = pipe_pool + pipe_pool_used;
+		pipe_pool_used += size;
+	}
+	return block;
+}
+
+void
+pool_free (void *block, size_t size)
+{
+	void **list = &pipe_pool_free[31 - clz(size)];
+
+	*(void **)block = *list;
+	*list = block;
+}
+
+/* Message buffers: fixed MSGBUF_SIZE blocks out of pipe_pool, handed to
+ * tasks by msgbuf_get and passed by handle through S_IBUFQ queues.  The
+ * ring of a buffer queue holds one pointer per slot, so posting and taking
+ * a message is a word move whatever its size, and the payload is filled
+ * and read in place.  Buffer i is the (i + 1)th block down from the end of
+ * the pool, away from ring storage, and msgbuf_map tells which are out, so
+ * a handle is only taken back if it is one of them. */
+#define MSGBUF(i) (pipe_pool + PIPE_POOL_SIZE - ((i) + 1) * MSGBUF_SIZE)
+
+void *
+msgbuf_get (void)
+{
+	unsigned int free = msgbuf_count ? ~msgbuf_map & (~0u << (32 - msgbuf_count))
+	                                 : 0;
+	unsigned int i;
+
+	if (free)
+		i = clz(free);
+	else if (MSGBUF_SIZE <= PIPE_POOL_SIZE - msgbuf_count * MSGBUF_SIZE -
+	                        pipe_pool_used)
+		i = msgbuf_count++;
+	else
+		return NULL;
+	msgbuf_map |= 0x80000000 >> i;
+	return MSGBUF(i);
+}
+
+/* The index of an allocated buffer, or -1 */
+int
+msgbuf_index (const void *buf)
+{
+	size_t offset = pipe_pool + PIPE_POOL_SIZE - (const char *)buf;
+	size_t i = offset / MSGBUF_SIZE - 1;
+
+	if ((const char *)buf < pipe_pool || offset % MSGBUF_SIZE ||
+	    !offset || i >= msgbuf_count || !(msgbuf_map & (0x80000000 >> i)))
+		return -1;
+	return i;
+}
+
+int
+msgbuf_valid (const void *buf)
+{
+	return msgbuf_index(buf) >= 0;
+}
+
+int
+msgbuf_put (void *buf)
+{
+	int i = msgbuf_index(buf);
+
+	if (i < 0)
+		return -1;
+	msgbuf_map &= ~(0x80000000 >> i);
+	return 0;
+}
+
+#define BUFQ_SLOT(pipe, index) \
+	(*(void **)((pipe)->data + ((index) & ((pipe)->size - 1))))
+
+int
+bufq_readable (struct pipe_ringbuffer *pipe,
+			   struct task_control_block *task)
+{
+	if (task->stack->r2 < sizeof(void *)) {
+		task->stack->r0 = -1;
+		return 0;
+	}
+	if (!PIPE_LEN(*pipe)) {
+		task->status = TASK_WAIT_READ;
+		return 0;
+	}
+	return 1;
+}
+
+/* Takes as many handles as are queued and fit in buf */
+int
+bufq_read (struct pipe_ringbuffer *pipe,
+		   struct task_control_block *task)
+{
+	void **buf = (void **)task->stack->r1;
+	size_t n = task->stack->r2 & ~(sizeof(void *) - 1);
+	size_t i;
+
+	if (n > PIPE_LEN(*pipe))
+		n = PIPE_LEN(*pipe);
+	for (i = 0; i < n; i += sizeof(void *)) {
+		*buf++ = BUFQ_SLOT(pipe, pipe->start);
+		pipe->start += sizeof(void *);
+	}
+	return n;
+}
+
+/* Handles are posted all at once, up to atomic bytes of them */
+int
+bufq_writable (struct pipe_ringbuffer *pipe,
+			   struct task_control_block *task)
+{
+	void **buf = (void **)task->stack->r1;
+	size_t n = task->stack->r2;
+	size_t i;
+
+	if (!n || n % sizeof(void *) || n > pipe->atomic) {
+		task->stack->r0 = -1;
+		return 0;
+	}
+	for (i = 0; i < n / sizeof(void *); i++) {
+		if (!msgbuf_valid(buf[i])) {
+			task->stack->r0 = -1;
+			return 0;
+		}
+	}
+	if (pipe->size - PIPE_LEN(*pipe) < n) {
+		task->status = TASK_WAIT_WRITE;
+		return 0;
+	}
+	return 1;
+}
+
 int
-_mknod(struct pipe_ringbuffer *pipe, int dev)
+bufq_write (struct pipe_ringbuffer *pipe,
+			struct task_control_block *task)
+{
+	void **buf = (void **)task->stack->r1;
+	size_t n = task->stack->r2;
+	size_t i;
+
+	for (i = 0; i < n; i += sizeof(void *)) {
+		BUFQ_SLOT(pipe, pipe->end) = *buf++;
+		pipe->end += sizeof(void *);
+	}
+	return n;
+}
+
+/* Give the pipe storage of attr->capacity bytes, rounded up to a power of
+ * two, or PIPE_BUF by default.  Storage is kept if the pipe is recreated
+ * with a capacity it already has. */
+int
+pipe_alloc(struct pipe_ringbuffer *pipe, const struct pipe_attr *attr)
+{
+	size_t capacity = (attr && attr->capacity) ? attr->capacity : PIPE_BUF;
+	size_t atomic = (attr && attr->atomic) ? attr->atomic : PIPE_BUF;
+	size_t size = sizeof(size_t);
+	size_t lowat;
+
+	/* Neither can be more than the pool, nor overflow the rounding up */
+	if (capacity > PIPE_POOL_SIZE || atomic > PIPE_POOL_SIZE)
+		return 1;
+	while (size < capacity)
+		size <<= 1;
+
+	if (!pipe->data || pipe->size < size) {
+		char *data = pool_alloc(size);
+		if (!data)
+			return 1;
+		if (pipe->data)
+			pool_free(pipe->data, pipe->size);
+		pipe->data = data;
+		pipe->size = size;
+		pipe->start = pipe->end = 0;
+	}
+	pipe->atomic = (atomic < pipe->size) ? atomic : pipe->size;
+	lowat = (attr && attr->lowat) ? attr->lowat : 1;
+	pipe->lowat = (lowat < pipe->size) ? lowat : pipe->size;
+	return 0;
+}
+
+int
+_mknod(struct pipe_ringbuffer *pipe, int dev, const struct pipe_attr *attr)
 {
+	if (dev < S_IFIFO || dev > S_IBUFQ)
+		return 1;
+	if (dev == S_IFIRQ &&
+	    (!attr || attr->irq < 0 || attr->irq >= IRQ_LIMIT ||
+	     irq_handlers[attr->irq]))
+		return 1;
+	/* Channels copy task to task and need no ring */
+	if (dev != S_IFCHAN && pipe_alloc(pipe, attr))
+		return 1;
+	if (pipe->irq >= 0) {
+		irq_unregister(pipe->irq);
+		pipe->irq = -1;
+	}
+	pipe->kick = NULL;
+
 	switch(dev) {
 	case S_IFIFO:
 		pipe->readable = fifo_readable;
@@ -975,178 +1753,2046 @@ _mknod(struct pipe_ringbuffer *pipe, int dev)
 		pipe->read = mq_read;
 		pipe->write = mq_write;
 		break;
+	case S_IFIRQ:
+		pipe->readable = irq_readable;
+		pipe->writable = pipe_badop;
+		pipe->read = (attr->flags & IRQ_TIMESTAMP) ? irq_stamp_read
+		                                          : irq_count_read;
+		pipe->write = pipe_badop;
+		pipe->start = pipe->end = 0;
+		pipe->irq = attr->irq;
+		pipe->exti = attr->exti;
+		irq_pipe[pipe->irq] = pipe - pipes;
+		irq_register(pipe->irq, irq_event);
+		break;
+	case S_IBUFQ:
+		pipe->readable = bufq_readable;
+		pipe->writable = bufq_writable;
+		pipe->read = bufq_read;
+		pipe->write = bufq_write;
+		pipe->start = pipe->end = 0;
+		break;
+	case S_IFCHAN:
+		pipe->readable = pipe_badop;
+		pipe->writable = pipe_badop;
+		pipe->read = pipe_badop;
+		pipe->write = pipe_badop;
+		pipe->start = pipe->end = 0;
+		pipe->owner = NULL;
+		break;
 	default:
 		return 1;
 	}
+	pipe->dev = dev;
 	return 0;
 }
 
-int main()
+/* Take an unused pipe object off pipe_free and make it a dev pipe */
+struct pipe_ringbuffer *
+pipe_create (int dev, const struct pipe_attr *attr)
 {
-	unsigned int stacks[TASK_LIMIT][STACK_SIZE];
-	struct pipe_ringbuffer pipes[PIPE_LIMIT];
-	struct task_control_block *ready_list[PRIORITY_LIMIT + 1];  /* [0 ... 39] */
-	struct task_control_block *wait_list = NULL;
-	size_t current_task = 0;
-	size_t i;
-	struct task_control_block *task;
-	int timeup;
-	unsigned int tick_count = 0;
+	struct pipe_ringbuffer *pipe = pipe_free;
+
+	if (!pipe || _mknod(pipe, dev, attr))
+		return NULL;
+	pipe_free = pipe->next;
+	pipe->refs = 0;
+	pipe->pollers = 0;
+	return pipe;
+}
 
-	SysTick_Config(configCPU_CLOCK_HZ / configTICK_RATE_HZ);
+/* Drop a reference, releasing the pipe and its storage with the last one */
+void
+pipe_put (struct pipe_ringbuffer *pipe)
+{
+	if (--pipe->refs == 0) {
+		if (pipe->irq >= 0) {
+			irq_unregister(pipe->irq);
+			pipe->irq = -1;
+		}
+		if (pipe->data)
+			pool_free(pipe->data, pipe->size);
+		pipe->data = NULL;
+		pipe->next = pipe_free;
+		pipe_free = pipe;
+	}
+}
 
-	init_rs232();
-	__enable_irq();
+/* Open pipe in task on its lowest free fd */
+int
+fd_alloc (struct task_control_block *task, struct pipe_ringbuffer *pipe)
+{
+	int fd;
 
-	tasks[task_count].stack = (void*)init_task(stacks[task_count], &first);
-	tasks[task_count].pid = 0;
-	tasks[task_count].priority = PRIORITY_DEFAULT;
-	task_count++;
+	for (fd = 0; fd < FD_LIMIT; fd++) {
+		if (!task->fds[fd]) {
+			task->fds[fd] = pipe - pipes + 1;
+			task->fd_nonblock &= ~(1 << fd);
+			pipe->refs++;
+			return fd;
+		}
+	}
+	return -1;
+}
 
-	/* Initialize all pipes */
-	for (i = 0; i < PIPE_LIMIT; i++)
-		pipes[i].start = pipes[i].end = 0;
+int
+fd_close (struct task_control_block *task, unsigned int fd)
+{
+	struct pipe_ringbuffer *pipe = fd_pipe(task, fd);
 
-	/* Initialize fifos */
-	for (i = 0; i <= PATHSERVER_FD; i++)
-		_mknod(&pipes[i], S_IFIFO);
+	if (!pipe)
+		return -1;
+	task->fds[fd] = 0;
+	pipe_put(pipe);
+	return 0;
+}
 
-	/* Initialize ready lists */
-	for (i = 0; i <= PRIORITY_LIMIT; i++)
-		ready_list[i] = NULL;
+int
+fd_dup2 (struct task_control_block *task, unsigned int oldfd, unsigned int newfd)
+{
+	struct pipe_ringbuffer *pipe = fd_pipe(task, oldfd);
+
+	if (!pipe || newfd >= FD_LIMIT)
+		return -1;
+	if (oldfd != newfd) {
+		fd_close(task, newfd);
+		task->fds[newfd] = task->fds[oldfd];
+		task->fd_nonblock &= ~(1 << newfd);
+		task->fd_nonblock |= ((task->fd_nonblock >> oldfd) & 1) << newfd;
+		pipe->refs++;
+	}
+	return newfd;
+}
 
-	while (1) {
-		tasks[current_task].stack = activate(tasks[current_task].stack);
-		tasks[current_task].status = TASK_READY;
-		timeup = 0;
+/* Only O_NONBLOCK can be read or changed */
+int
+fd_fcntl (struct task_control_block *task, unsigned int fd, int cmd, int arg)
+{
+	if (!fd_pipe(task, fd))
+		return -1;
+	switch (cmd) {
+	case F_GETFL:
+		return (task->fd_nonblock & (1 << fd)) ? O_NONBLOCK : 0;
+	case F_SETFL:
+		if (arg & O_NONBLOCK)
+			task->fd_nonblock |= 1 << fd;
+		else
+			task->fd_nonblock &= ~(1 << fd);
+		return 0;
+	}
+	return -1;
+}
 
-		switch (tasks[current_task].stack->r7) {
-		case 0x1: /* fork */
-			if (task_count == TASK_LIMIT) {
-				/* Cannot create a new task, return error */
-				tasks[current_task].stack->r0 = -1;
-			}
-			else {
-				/* Compute how much of the stack is used */
-				size_t used = stacks[current_task] + STACK_SIZE
-					      - (unsigned int*)tasks[current_task].stack;
-				/* New stack is END - used */
-				tasks[task_count].stack = (void*)(stacks[task_count] + STACK_SIZE - used);
-				/* Copy only the used part of the stack */
-				memcpy(tasks[task_count].stack, tasks[current_task].stack,
-				       used * sizeof(unsigned int));
-				/* Set PID */
-				tasks[task_count].pid = task_count;
-				/* Set priority, inherited from forked task */
-				tasks[task_count].priority = tasks[current_task].priority;
-				/* Set return values in each process */
-				tasks[current_task].stack->r0 = task_count;
-				tasks[task_count].stack->r0 = 0;
-				tasks[task_count].prev = NULL;
-				tasks[task_count].next = NULL;
-				task_push(&ready_list[tasks[task_count].priority], &tasks[task_count]);
-				/* There is now one more task */
-				task_count++;
-			}
-			break;
-		case 0x2: /* getpid */
-			tasks[current_task].stack->r0 = current_task;
-			break;
-		case 0x3: /* write */
-			_write(&tasks[current_task], tasks, task_count, pipes);
-			break;
-		case 0x4: /* read */
-			_read(&tasks[current_task], tasks, task_count, pipes);
-			break;
-		case 0x5: /* interrupt_wait */
-			/* Enable interrupt */
-			NVIC_EnableIRQ(tasks[current_task].stack->r0);
-			/* Block task waiting for interrupt to happen */
-			tasks[current_task].status = TASK_WAIT_INTR;
-			break;
-		case 0x6: /* getpriority */
-			{
-				int who = tasks[current_task].stack->r0;
-				if (who > 0 && who < (int)task_count)
-					tasks[current_task].stack->r0 = tasks[who].priority;
-				else if (who == 0)
-					tasks[current_task].stack->r0 = tasks[current_task].priority;
-				else
-					tasks[current_task].stack->r0 = -1;
-			} break;
-		case 0x7: /* setpriority */
-			{
-				int who = tasks[current_task].stack->r0;
-				int value = tasks[current_task].stack->r1;
-				value = (value < 0) ? 0 : ((value > PRIORITY_LIMIT) ? PRIORITY_LIMIT : value);
-				if (who > 0 && who < (int)task_count)
-					tasks[who].priority = value;
-				else if (who == 0)
-					tasks[current_task].priority = value;
-				else {
-					tasks[current_task].stack->r0 = -1;
-					break;
-				}
-				tasks[current_task].stack->r0 = 0;
-			} break;
-		case 0x8: /* mknod */
-			if (tasks[current_task].stack->r0 < PIPE_LIMIT)
-				tasks[current_task].stack->r0 =
-					_mknod(&pipes[tasks[current_task].stack->r0],
-						   tasks[current_task].stack->r2);
-			else
-				tasks[current_task].stack->r0 = -1;
-			break;
-		case 0x9: /* sleep */
-			if (tasks[current_task].stack->r0 != 0) {
-				tasks[current_task].stack->r0 += tick_count;
-				tasks[current_task].status = TASK_WAIT_TIME;
-			}
-			break;
-		default: /* Catch all interrupts */
-			if ((int)tasks[current_task].stack->r7 < 0) {
-				unsigned int intr = -tasks[current_task].stack->r7 - 16;
-
-				if (intr == SysTick_IRQn) {
-					/* Never disable timer. We need it for pre-emption */
-					timeup = 1;
-					tick_count++;
-				}
-				else {
-					/* Disable interrupt, interrupt_wait re-enables */
-					NVIC_DisableIRQ(intr);
-				}
-				/* Unblock any waiting tasks */
-				for (i = 0; i < task_count; i++)
-					if ((tasks[i].status == TASK_WAIT_INTR && tasks[i].stack->r0 == intr) ||
-					    (tasks[i].status == TASK_WAIT_TIME && tasks[i].stack->r0 == tick_count))
-						tasks[i].status = TASK_READY;
-			}
+/* poll: a task waiting on several pipes sets its bit in each of their
+ * pollers masks instead of joining their wait queues.  Any change on such
+ * a pipe rescans the task's pollfd array, and the task is woken once
+ * something is ready.  Bits left behind on the other pipes are dropped
+ * lazily, the next time those pipes find the task no longer polling. */
+int
+pipe_poll (struct pipe_ringbuffer *pipe)
+{
+	int revents = 0;
+
+	if (pipe->readable != pipe_badop && PIPE_LEN(*pipe) >= pipe->lowat)
+		revents |= POLLIN;
+	if (pipe->writable != pipe_badop &&
+	    pipe->size - PIPE_LEN(*pipe) >= pipe->atomic)
+		revents |= POLLOUT;
+	return revents;
+}
+
+/* Fill in revents for the task's poll arguments and return the number of
+ * ready fds.  With arm, also register the task on each pipe. */
+int
+poll_scan (struct task_control_block *task, int arm)
+{
+	struct pollfd *fds = (struct pollfd *)task->stack->r0;
+	size_t nfds = task->stack->r1;
+	struct pipe_ringbuffer *pipe;
+	int ready = 0;
+	size_t i;
+
+	for (i = 0; i < nfds; i++) {
+		pipe = fd_pipe(task, fds[i].fd);
+		if (!pipe) {
+			fds[i].revents = POLLNVAL;
+		}
+		else {
+			fds[i].revents = pipe_poll(pipe) & fds[i].events;
+			if (arm)
+				pipe->pollers |= 1 << (task - tasks);
 		}
+		if (fds[i].revents)
+			ready++;
+	}
+	return ready;
+}
+
+/* Start a poll for task, which either completes with the ready count in
+ * r0 or leaves the task in TASK_WAIT_POLL with r0 = 0 for a timeout */
+void
+poll_start (struct task_control_block *task)
+{
+	int timeout = task->stack->r2;
+	int ready = poll_scan(task, 0);
+
+	if (ready || timeout == 0) {
+		task->stack->r0 = ready;
+		return;
+	}
+	poll_scan(task, 1);
+	task->stack->r0 = 0;
+	task->status = TASK_WAIT_POLL;
+	if (timeout > 0)
+		timer_insert(task, tick_count + timeout);
+}
 
-		/* Put waken tasks in ready list */
-		for (task = wait_list; task != NULL;) {
-			struct task_control_block *next = task->next;
-			if (task->status == TASK_READY)
-				task_push(&ready_list[task->priority], task);
-			task = next;
+int retry_syscall (struct task_control_block *task);
+
+/* Also retries syscalls in TASK_WAIT_RETRY, which use the same mask */
+void
+poll_wake (struct pipe_ringbuffer *pipe)
+{
+	struct task_control_block *task;
+	unsigned int pollers = pipe->pollers;
+	unsigned int i;
+	int ready;
+
+	while (pollers) {
+		i = 31 - clz(pollers);
+		pollers &= ~(1 << i);
+		task = &tasks[i];
+		if (task->status == TASK_WAIT_RETRY) {
+			if (retry_syscall(task)) {
+				pipe->pollers &= ~(1 << i);
+				ready_push(task);
+			}
 		}
-		/* Select next TASK_READY task */
-		for (i = 0; i < (size_t)tasks[current_task].priority && ready_list[i] == NULL; i++);
-		if (tasks[current_task].status == TASK_READY) {
-			if (!timeup && i == (size_t)tasks[current_task].priority)
-				/* Current task has highest priority and remains execution time */
-				continue;
-			else
-				task_push(&ready_list[tasks[current_task].priority], &tasks[current_task]);
+		else if (task->status != TASK_WAIT_POLL) {
+			pipe->pollers &= ~(1 << i);
 		}
-		else {
-			task_push(&wait_list, &tasks[current_task]);
+		else if ((ready = poll_scan(task, 0)) != 0) {
+			pipe->pollers &= ~(1 << i);
+			timer_remove(task);
+			task->stack->r0 = ready;
+			task->status = TASK_READY;
+			ready_push(task);
 		}
-		while (ready_list[i] == NULL)
-			i++;
-		current_task = task_pop(&ready_list[i])->pid;
 	}
+}
+
+/* Synchronous message passing over S_IFCHAN pipes, which have no ring.
+ * A sender blocks on the channel until a receiver takes its message, then
+ * until that receiver replies.  Each message and reply is copied once,
+ * straight between the two tasks' buffers.  The receiving server inherits
+ * the priority of every client waiting for it. */
+
+/* Move the sender's message into the receiver's buffer.  The sender is
+ * left reply-blocked on the receiver. */
+void
+msg_transfer (struct task_control_block *sender,
+              struct task_control_block *receiver)
+{
+	struct task_control_block *waited = sender->waits_for;
+	size_t n = sender->stack->r2;
+
+	if (n > receiver->stack->r2)
+		n = receiver->stack->r2;
+	memcpy((void *)receiver->stack->r1, (const void *)sender->stack->r1, n);
+	if (receiver->stack->r3)
+		*(size_t *)receiver->stack->r3 = sender->stack->r2;
+	receiver->stack->r0 = sender->pid;	/* rcvid */
+
+	sender->status = TASK_WAIT_REPLY;
+	sender->waits_for = receiver;
+	task_reprioritize(receiver);
+	if (waited != receiver)
+		task_reprioritize(waited);
+}
+
+/* msg_send(fd, msg, len, reply): reply_len is the fifth argument, which the
+ * syscall stub passes in r4 */
+void
+_msg_send (struct task_control_block *task)
+{
+	struct pipe_ringbuffer *chan = fd_pipe(task, task->stack->r0);
+	struct task_control_block *receiver;
+
+	if (!chan || chan->dev != S_IFCHAN) {
+		task->stack->r0 = -1;
+		return;
+	}
+	if ((receiver = task_pop(&chan->readers)) != NULL) {
+		timer_remove(receiver);
+		receiver->status = TASK_READY;
+		ready_push(receiver);
+		msg_transfer(task, receiver);
+	}
+	else {
+		task->status = TASK_WAIT_SEND;
+		task_insert(&chan->writers, task);
+		task->waits_for = chan->owner;
+		task_reprioritize(chan->owner);
+	}
+}
+
+/* msg_receive(fd, buf, len, &msg_len): returns the rcvid to reply to */
+void
+_msg_receive (struct task_control_block *task)
+{
+	struct pipe_ringbuffer *chan = fd_pipe(task, task->stack->r0);
+	struct task_control_block *sender;
+
+	if (!chan || chan->dev != S_IFCHAN) {
+		task->stack->r0 = -1;
+		return;
+	}
+	if (chan->owner != task) {
+		/* Queued senders now wait for this task */
+		struct task_control_block *owner = chan->owner;
+		chan->owner = task;
+		for (sender = chan->writers.head; sender; sender = sender->next)
+			sender->waits_for = task;
+		task_reprioritize(owner);
+		task_reprioritize(task);
+	}
+	if ((sender = task_pop(&chan->writers)) != NULL) {
+		msg_transfer(sender, task);
+	}
+	else {
+		task->status = TASK_WAIT_READ;
+		task_insert(&chan->readers, task);
+	}
+}
+
+/* msg_reply(rcvid, status, reply, len): msg_send returns status */
+void
+_msg_reply (struct task_control_block *task)
+{
+	struct task_control_block *client = task_lookup(task->stack->r0);
+	size_t n = task->stack->r3;
+
+	if (!client || client->status != TASK_WAIT_REPLY ||
+	    client->waits_for != task) {
+		task->stack->r0 = -1;
+		return;
+	}
+	if (n > client->stack->r4)
+		n = client->stack->r4;
+	memcpy((void *)client->stack->r3, (const void *)task->stack->r2, n);
+	client->stack->r0 = task->stack->r1;
+	client->waits_for = NULL;
+	client->status = TASK_READY;
+	ready_push(client);
+	task_reprioritize(task);
+	task->stack->r0 = 0;
+}
+
+/* Task notifications and event groups: 32-bit words of flags that tasks
+ * wait on with a mask, for any or (EV_ALL) all of its bits.  A wait that
+ * is met returns the matched bits and, with EV_CLEAR, clears them.  Bits
+ * are only ever changed through the bit-band alias, a single store that
+ * cannot tear against an interrupt handler setting other bits. */
+#define BITBAND_SRAM(addr, bit) \
+	(*(volatile unsigned int *)(SRAM_BB_BASE + \
+		(((unsigned int)(addr) - SRAM_BASE) << 5) + ((bit) << 2)))
+
+struct event_group {
+	unsigned int bits;
+	struct task_list waiters;	/* By priority, mask in r1, flags in r2 */
+};
+
+struct event_group event_groups[EVENT_LIMIT];
+
+void
+event_bits (unsigned int *word, unsigned int bits, int value)
+{
+	unsigned int bit;
+
+	while (bits) {
+		bit = 31 - clz(bits);
+		BITBAND_SRAM(word, bit) = value;
+		bits &= ~(1 << bit);
+	}
+}
+
+/* Returns the bits of *word that meet a wait for mask, or 0 */
+unsigned int
+event_match (unsigned int *word, unsigned int mask, int flags)
+{
+	unsigned int match = *word & mask;
+
+	if (!match || ((flags & EV_ALL) && match != mask))
+		return 0;
+	if (flags & EV_CLEAR)
+		event_bits(word, match, 0);
+	return match;
+}
+
+void
+event_ready (struct task_control_block *task, unsigned int match)
+{
+	task_remove(task);
+	timer_remove(task);
+	task->stack->r0 = match;
+	task->status = TASK_READY;
+	ready_push(task);
+}
+
+/* Wake the waiters of a group whose wait is now met, in priority order */
+int
+event_wake (struct event_group *group)
+{
+	struct task_control_block *task, *next;
+	unsigned int match;
+	int woken = 0;
+
+	for (task = group->waiters.head; task; task = next) {
+		next = task->next;
+		match = event_match(&group->bits, task->stack->r1, task->stack->r2);
+		if (match) {
+			event_ready(task, match);
+			woken = 1;
+		}
+	}
+	return woken;
+}
+
+/* Returns nonzero if a task was woken */
+int
+notify_wake (struct task_control_block *task)
+{
+	unsigned int match;
+
+	if (task->status != TASK_WAIT_NOTIFY)
+		return 0;
+	match = event_match(&task->notify, task->stack->r0, task->stack->r1);
+	if (match)
+		event_ready(task, match);
+	return match != 0;
+}
+
+/* Interrupt-side calls, the wakeups run once the handler is done */
+void
+event_isr_set (unsigned int group, unsigned int bits)
+{
+	event_bits(&event_groups[group].bits, bits, 1);
+	if (event_groups[group].waiters.head)
+		event_pending |= 0x80000000 >> group;
+}
+
+void
+notify_isr (unsigned int pid, unsigned int bits)
+{
+	struct task_control_block *task = task_lookup(pid);
+
+	if (!task)
+		return;
+	event_bits(&task->notify, bits, 1);
+	if (task->status == TASK_WAIT_NOTIFY)
+		notify_pending |= 0x80000000 >> (task - tasks);
+}
+
+void
+event_wake_pending (void)
+{
+	unsigned int i;
+
+	while (event_pending) {
+		i = clz(event_pending);
+		event_pending &= ~(0x80000000 >> i);
+		event_wake(&event_groups[i]);
+	}
+	while (notify_pending) {
+		i = clz(notify_pending);
+		notify_pending &= ~(0x80000000 >> i);
+		notify_wake(&tasks[i]);
+	}
+}
+
+/* notify(pid, bits) */
+int
+notify_set (struct task_control_block *task)
+{
+	struct task_control_block *target = task_lookup(task->stack->r0);
+
+	if (!target) {
+		task->stack->r0 = -1;
+		return 0;
+	}
+	event_bits(&target->notify, task->stack->r1, 1);
+	task->stack->r0 = 0;
+	return notify_wake(target);
+}
+
+/* notify_wait(mask, flags, ticks) */
+void
+_notify_wait (struct task_control_block *task)
+{
+	unsigned int match;
+
+	if (!task->stack->r0) {
+		task->stack->r0 = -1;
+		return;
+	}
+	match = event_match(&task->notify, task->stack->r0, task->stack->r1);
+	if (match) {
+		task->stack->r0 = match;
+		return;
+	}
+	task->status = TASK_WAIT_NOTIFY;
+	timer_bound(task, task->stack->r2);
+}
+
+/* event_set(group, bits) and event_clear(group, bits), which return the
+ * bits as they were */
+int
+event_update (struct task_control_block *task, int value)
+{
+	unsigned int group = task->stack->r0;
+	unsigned int old;
+
+	if (group >= EVENT_LIMIT) {
+		task->stack->r0 = -1;
+		return 0;
+	}
+	old = event_groups[group].bits;
+	event_bits(&event_groups[group].bits, task->stack->r1, value);
+	task->stack->r0 = old;
+	return value && event_wake(&event_groups[group]);
+}
+
+/* event_wait(group, mask, flags, ticks) */
+void
+_event_wait (struct task_control_block *task)
+{
+	unsigned int group = task->stack->r0;
+	unsigned int match;
+
+	if (group >= EVENT_LIMIT || !task->stack->r1) {
+		task->stack->r0 = -1;
+		return;
+	}
+	match = event_match(&event_groups[group].bits, task->stack->r1,
+	                    task->stack->r2);
+	if (match) {
+		task->stack->r0 = match;
+		return;
+	}
+	task->status = TASK_WAIT_EVENT;
+	task_insert(&event_groups[group].waiters, task);
+	timer_bound(task, task->stack->r3);
+}
+
+/* Mutexes and counting semaphores are words in user memory, taken and
+ * released with LDREX/STREX in syscall.s while uncontended.  The kernel
+ * only sees them once a task has to block: it then sets LOCK_WAITERS,
+ * which sends the release to the kernel too.  Kernel entry clears the
+ * exclusive monitor, so the kernel's plain stores never race a user
+ * update.  A mutex word holds its owner's pid + 1, a semaphore its count.
+ * Waiters are blocked tasks with the word's address in r0. */
+#define LOCK_WAITERS 0x80000000
+
+/* The highest priority task blocked on word, if any, and whether there
+ * is another one besides */
+struct task_control_block *
+lock_waiter (unsigned int *word, int status, int *more)
+{
+	struct task_control_block *best = NULL;
+	size_t i;
+
+	*more = 0;
+	for (i = 0; i < task_count; i++) {
+		if (tasks[i].status != status ||
+		    tasks[i].stack->r0 != (unsigned int)word)
+			continue;
+		if (best) {
+			*more = 1;
+			if (tasks[i].priority >= best->priority)
+				continue;
+		}
+		best = &tasks[i];
+	}
+	return best;
+}
+
+void
+_mutex_lock (struct task_control_block *task)
+{
+	unsigned int *word = (unsigned int *)task->stack->r0;
+	struct task_control_block *holder;
+	unsigned int owner;
+
+	if ((unsigned int)word & 3) {
+		task->stack->r0 = -1;
+		return;
+	}
+	owner = *word & ~LOCK_WAITERS;
+	if (!owner) {
+		*word = task->pid + 1;
+		task->stack->r0 = 0;
+		return;
+	}
+	holder = task_lookup(owner - 1);
+	if (holder == task) {
+		task->stack->r0 = -1;
+		return;
+	}
+	if (!holder) {
+		/* The owner exited holding it */
+		*word = task->pid + 1;
+		task->stack->r0 = -EOWNERDEAD;
+		return;
+	}
+	*word |= LOCK_WAITERS;
+	task->status = TASK_WAIT_MUTEX;
+	task->waits_for = holder;
+	task_reprioritize(holder);
+}
+
+/* Hand the mutex straight to its highest priority waiter, which returns
+ * status, and make its blocked peers wait for it instead.  Returns the
+ * new owner, or NULL if the mutex is now free. */
+struct task_control_block *
+mutex_handoff (unsigned int *word, int status)
+{
+	struct task_control_block *next;
+	size_t i;
+	int more;
+
+	next = lock_waiter(word, TASK_WAIT_MUTEX, &more);
+	if (!next) {
+		*word = 0;
+		return NULL;
+	}
+	*word = (next->pid + 1) | (more ? LOCK_WAITERS : 0);
+	next->waits_for = NULL;
+	for (i = 0; i < task_count; i++)
+		if (tasks[i].status == TASK_WAIT_MUTEX && &tasks[i] != next &&
+		    tasks[i].stack->r0 == (unsigned int)word)
+			tasks[i].waits_for = next;
+	next->stack->r0 = status;
+	next->status = TASK_READY;
+	ready_push(next);
+	task_reprioritize(next);
+	return next;
+}
+
+/* Returns nonzero if a task was woken */
+int
+_mutex_unlock (struct task_control_block *task)
+{
+	unsigned int *word = (unsigned int *)task->stack->r0;
+	int woken;
+
+	if ((unsigned int)word & 3 ||
+	    (*word & ~LOCK_WAITERS) != (unsigned int)task->pid + 1) {
+		task->stack->r0 = -1;
+		return 0;
+	}
+	task->stack->r0 = 0;
+	woken = mutex_handoff(word, 0) != NULL;
+	task_reprioritize(task);
+	return woken;
+}
+
+void
+_sem_wait (struct task_control_block *task)
+{
+	unsigned int *word = (unsigned int *)task->stack->r0;
+
+	if ((unsigned int)word & 3) {
+		task->stack->r0 = -1;
+		return;
+	}
+	if (*word & ~LOCK_WAITERS) {
+		*word -= 1;
+		task->stack->r0 = 0;
+		return;
+	}
+	*word |= LOCK_WAITERS;
+	task->status = TASK_WAIT_SEM;
+}
+
+/* A post with waiters goes straight to the highest priority one, the
+ * count stays at 0.  Returns nonzero if a task was woken. */
+int
+_sem_post (struct task_control_block *task)
+{
+	unsigned int *word = (unsigned int *)task->stack->r0;
+	struct task_control_block *next;
+	int more;
+
+	if ((unsigned int)word & 3) {
+		task->stack->r0 = -1;
+		return 0;
+	}
+	task->stack->r0 = 0;
+	next = lock_waiter(word, TASK_WAIT_SEM, &more);
+	if (!next) {
+		*word = (*word & ~LOCK_WAITERS) + 1;
+		return 0;
+	}
+	if (!more)
+		*word &= ~LOCK_WAITERS;
+	next->stack->r0 = 0;
+	next->status = TASK_READY;
+	ready_push(next);
+	return 1;
+}
+
+/* futex_wait(word, value, ticks): block while *word is value, checked in
+ * the kernel so that a futex_wake after the caller's last look is never
+ * lost */
+void
+_futex_wait (struct task_control_block *task)
+{
+	unsigned int *word = (unsigned int *)task->stack->r0;
+
+	if ((unsigned int)word & 3) {
+		task->stack->r0 = -1;
+		return;
+	}
+	if (*word != task->stack->r1) {
+		task->stack->r0 = -EAGAIN;
+		return;
+	}
+	task->status = TASK_WAIT_FUTEX;
+	timer_bound(task, task->stack->r2);
+}
+
+/* futex_wake(word, count): wake up to count waiters by priority and
+ * return how many were woken */
+int
+_futex_wake (struct task_control_block *task)
+{
+	unsigned int *word = (unsigned int *)task->stack->r0;
+	struct task_control_block *next;
+	int count = task->stack->r1;
+	int woken = 0;
+	int more = 1;
+
+	while (woken < count && more) {
+		next = lock_waiter(word, TASK_WAIT_FUTEX, &more);
+		if (!next)
+			break;
+		timer_remove(next);
+		next->stack->r0 = 0;
+		next->status = TASK_READY;
+		ready_push(next);
+		woken++;
+	}
+	task->stack->r0 = woken;
+	return woken;
+}
+
+/* Kernel name table, mapping absolute paths to pipes.  Names are hashed
+ * into PATH_HASH chains; unused entries sit on path_free.  A name holds a
+ * reference on its pipe until it is unlinked. */
+struct path_entry {
+	char name[PATH_MAX];
+	struct pipe_ringbuffer *pipe;
+	struct path_entry *next;
+};
+
+struct path_entry path_entries[PATH_LIMIT];
+struct path_entry *path_hash[PATH_HASH];
+struct path_entry *path_free = NULL;
+
+/* FNV-1a */
+unsigned int
+path_hashfn (const char *name)
+{
+	unsigned int hash = 2166136261U;
+	while (*name)
+		hash = (hash ^ (unsigned char)*name++) * 16777619U;
+	return hash & (PATH_HASH - 1);
+}
+
+/* Returns the link pointing at the entry for name, or at the NULL
+ * ending its chain if there is none */
+struct path_entry **
+path_find (const char *name)
+{
+	struct path_entry **link = &path_hash[path_hashfn(name)];
+	while (*link && strcmp((*link)->name, name) != 0)
+		link = &((*link)->next);
+	return link;
+}
+
+/* Open name on a new fd of task */
+int
+path_open (struct task_control_block *task, const char *name, int flags)
+{
+	struct path_entry *entry = *path_find(name);
+	int fd = entry ? fd_alloc(task, entry->pipe) : -1;
+
+	if (fd >= 0)
+		fd_fcntl(task, fd, F_SETFL, flags);
+	return fd;
+}
+
+/* Create a pipe of type dev and register it under name */
+int
+path_create (const char *name, int dev, const struct pipe_attr *attr)
+{
+	size_t len = strlen(name) + 1;
+	struct path_entry **link = path_find(name);
+	struct path_entry *entry;
+	struct pipe_ringbuffer *pipe;
+
+	if (len > PATH_MAX || *link || !path_free)
+		return -1;
+	if (!(pipe = pipe_create(dev, attr)))
+		return -1;
+
+	entry = path_free;
+	path_free = entry->next;
+	memcpy(entry->name, name, len);
+	entry->pipe = pipe;
+	entry->next = NULL;
+	pipe->refs++;
+	*link = entry;
+	return 0;
+}
+
+/* Remove the name, fds already open on it stay valid */
+int
+path_unlink (const char *name)
+{
+	struct path_entry **link = path_find(name);
+	struct path_entry *entry = *link;
+
+	if (!entry)
+		return -1;
+	*link = entry->next;
+	pipe_put(entry->pipe);
+	entry->next = path_free;
+	path_free = entry;
+	return 0;
+}
+
+/* Kernel tty driver for USART2, serviced by its interrupt without a
+ * task in between.  Output written to the out pipe is drained one byte per
+ * TXE interrupt.  Input is edited into a line just past in->end and only
+ * committed when the line ends, so readers are woken once per line. */
+struct tty {
+	USART_TypeDef *uart;
+	struct pipe_ringbuffer *in;	/* Cooked input, whole lines */
+	struct pipe_ringbuffer *out;	/* Output waiting for the transmitter */
+	unsigned int edit;	/* Length of the line being edited */
+};
+
+struct tty tty0;
+
+int
+tty_readable (struct pipe_ringbuffer *pipe,
+			  struct task_control_block *task)
+{
+	if (!PIPE_LEN(*pipe)) {
+		task->status = TASK_WAIT_READ;
+		return 0;
+	}
+	return 1;
+}
+
+/* Hand out at most one line, including its newline */
+int
+tty_read (struct pipe_ringbuffer *pipe,
+		  struct task_control_block *task)
+{
+	size_t len = PIPE_LEN(*pipe);
+	size_t n = 0;
+
+	if (len > task->stack->r2)
+		len = task->stack->r2;
+	while (n < len && pipe->data[(pipe->start + n++) & (pipe->size - 1)] != '\n')
+		;
+	pipe_pop(pipe, (char*)task->stack->r1, n);
+	return n;
+}
+
+/* Start the transmitter on new output, however it got into the ring */
+void
+tty_kick (struct pipe_ringbuffer *pipe)
+{
+	USART_ITConfig(tty0.uart, USART_IT_TXE, ENABLE);
+}
+
+int
+tty_write (struct pipe_ringbuffer *pipe,
+		   struct task_control_block *task)
+{
+	int n = fifo_write(pipe, task);
+	tty_kick(pipe);
+	return n;
+}
+
+/* Echo is dropped rather than waited for when output is backed up */
+void
+tty_echo (struct tty *tty, const char *s, size_t n)
+{
+	if (tty->out->size - PIPE_LEN(*tty->out) >= n) {
+		pipe_push(tty->out, s, n);
+		USART_ITConfig(tty->uart, USART_IT_TXE, ENABLE);
+	}
+}
+
+/* Line discipline */
+void
+tty_input (struct tty *tty, char c)
+{
+	struct pipe_ringbuffer *in = tty->in;
+
+	if (c == '\r')
+		c = '\n';
+	if (c == '\b' || c == 127) {
+		if (tty->edit) {
+			tty->edit--;
+			tty_echo(tty, "\b \b", 3);
+		}
+		return;
+	}
+	/* Keep the last byte for the newline */
+	if (PIPE_LEN(*in) + tty->edit >= in->size - (c != '\n'))
+		return;
+
+	in->data[(in->end + tty->edit++) & (in->size - 1)] = c;
+	if (c != '\n') {
+		tty_echo(tty, &c, 1);
+		return;
+	}
+	tty_echo(tty, "\r\n", 2);
+	in->end += tty->edit;
+	tty->edit = 0;
+	pipe_isr_wake(in);
+}
+
+/* USART2 interrupt handler */
+void
+tty_irq (unsigned int irq)
+{
+	struct tty *tty = &tty0;
+	struct pipe_ringbuffer *out = tty->out;
+	struct task_control_block *writer;
+
+	if (USART_GetITStatus(tty->uart, USART_IT_RXNE) != RESET)
+		tty_input(tty, USART_ReceiveData(tty->uart));
+
+	if (USART_GetITStatus(tty->uart, USART_IT_TXE) != RESET) {
+		if (PIPE_LEN(*out)) {
+			USART_SendData(tty->uart, out->data[out->start++ & (out->size - 1)]);
+			/* Wake a blocked writer once all of its write fits */
+			writer = out->writers.head;
+			if ((writer && out->size - PIPE_LEN(*out) == writer->stack->r2) ||
+			    !PIPE_LEN(*out))
+				pipe_isr_wake(out);
+		}
+		else {
+			USART_ITConfig(tty->uart, USART_IT_TXE, DISABLE);
+		}
+	}
+}
+
+/* Create /dev/tty0/in and /dev/tty0/out and start taking interrupts */
+void
+tty_init (struct tty *tty, USART_TypeDef *uart)
+{
+	struct pipe_attr in_attr = { TTY_IN_SIZE, TTY_IN_SIZE };
+	struct pipe_attr out_attr = { TTY_OUT_SIZE, TTY_OUT_SIZE };
+
+	path_create("/dev/tty0/in", S_IFIFO, &in_attr);
+	path_create("/dev/tty0/out", S_IFIFO, &out_attr);
+	tty->uart = uart;
+	tty->in = (*path_find("/dev/tty0/in"))->pipe;
+	tty->out = (*path_find("/dev/tty0/out"))->pipe;
+	tty->edit = 0;
+
+	/* The driver's own references keep the pipes alive across unlink */
+	tty->in->refs++;
+	tty->out->refs++;
+
+	tty->in->readable = tty_readable;
+	tty->in->read = tty_read;
+	/* The interrupt handler is the only consumer of out and producer of in */
+	tty->in->writable = pipe_badop;
+	tty->out->readable = pipe_badop;
+	tty->out->write = tty_write;
+	tty->out->kick = tty_kick;
+
+	USART_ITConfig(uart, USART_IT_RXNE, ENABLE);
+	irq_register(USART2_IRQn, tty_irq);
+}
+
+/* splice(fd_in, fd_out, len, flags) moves data between two FIFOs or
+ * message queues, the tty included, without passing through the caller.
+ * A message queue source gives up one whole message, and a message queue
+ * destination takes what is moved as one message.  The caller waits like
+ * a poller, on the pollers masks of both pipes. */
+void
+pipe_move (struct pipe_ringbuffer *out, struct pipe_ringbuffer *in, size_t n)
+{
+	size_t offset, chunk;
+
+	while (n) {
+		offset = in->start & (in->size - 1);
+		chunk = in->size - offset;
+		if (chunk > n)
+			chunk = n;
+		pipe_push(out, in->data + offset, chunk);
+		in->start += chunk;
+		n -= chunk;
+	}
+	if (out->kick)
+		out->kick(out);
+}
+
+/* Try the splice task is making.  Returns 0 if it has to wait, else 1
+ * with the byte count or -1 in r0. */
+int
+splice_try (struct task_control_block *task)
+{
+	struct pipe_ringbuffer *in = fd_pipe(task, task->stack->r0);
+	struct pipe_ringbuffer *out = fd_pipe(task, task->stack->r1);
+	size_t len = task->stack->r2;
+	size_t room, header = 0;
+	size_t n;
+
+	if (!in || !out || in == out ||
+	    (in->dev != S_IFIFO && in->dev != S_IMSGQ) ||
+	    (out->dev != S_IFIFO && out->dev != S_IMSGQ) ||
+	    in->readable == pipe_badop || out->writable == pipe_badop) {
+		task->stack->r0 = -1;
+		task->status = TASK_READY;
+		return 1;
+	}
+
+	if (out->dev == S_IMSGQ)
+		header = sizeof(size_t);
+	room = out->size - PIPE_LEN(*out);
+	room = (room > header) ? room - header : 0;
+
+	if (in->dev == S_IMSGQ) {
+		if (PIPE_LEN(*in) < sizeof(size_t))
+			return 0;
+		pipe_peek(in, &n, sizeof(size_t));
+		/* The message has to go across whole */
+		if (n > len || header + n > out->atomic) {
+			task->stack->r0 = -1;
+			task->status = TASK_READY;
+			return 1;
+		}
+		if (n > room)
+			return 0;
+		in->start += sizeof(size_t);
+	}
+	else {
+		n = PIPE_LEN(*in);
+		if (n > len)
+			n = len;
+		if (header && n > out->atomic - header)
+			n = out->atomic - header;
+		if (n > room)
+			n = room;
+		if (!n)
+			return 0;
+	}
+
+	if (header)
+		pipe_push(out, &n, sizeof(size_t));
+	pipe_move(out, in, n);
+	task->stack->r0 = n;
+
+	/* Done before the wake passes, which may come back to this task */
+	task->status = TASK_READY;
+	pipe_wake(in);
+	pipe_wake(out);
+	return 1;
+}
+
+/* Park task as a poller of pipe until retry_syscall can complete it */
+void
+retry_wait (struct task_control_block *task, struct pipe_ringbuffer *pipe)
+{
+	pipe->pollers |= 1 << (task - tasks);
+	task->status = TASK_WAIT_RETRY;
+}
+
+void
+splice_start (struct task_control_block *task)
+{
+	struct pipe_ringbuffer *in, *out;
+
+	if (splice_try(task))
+		return;
+	if ((task->stack->r3 & SPLICE_F_NONBLOCK) ||
+	    fd_wouldblock(task, task->stack->r0) ||
+	    fd_wouldblock(task, task->stack->r1)) {
+		task->stack->r0 = -EAGAIN;
+		return;
+	}
+	in = fd_pipe(task, task->stack->r0);
+	out = fd_pipe(task, task->stack->r1);
+	retry_wait(task, in);
+	retry_wait(task, out);
+}
+
+/* Vectored I/O on FIFOs and message queues.  writev(fd, iov, iovcnt)
+ * gathers into one write, atomic under the same rules as write; on a
+ * message queue it makes one message.  readv scatters one read, or one
+ * message.  mq_receive_batch(fd, msgs, count) takes as many messages as
+ * fit, one per iovec, and sets each iov_len to the message length. */
+size_t
+iov_total (const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+
+	while (iovcnt--)
+		total += (iov++)->iov_len;
+	return total;
+}
+
+/* Gather n bytes from iov into the ring */
+void
+pipe_pushv (struct pipe_ringbuffer *pipe, const struct iovec *iov, size_t n)
+{
+	size_t chunk;
+
+	for (; n; iov++) {
+		chunk = iov->iov_len < n ? iov->iov_len : n;
+		pipe_push(pipe, iov->iov_base, chunk);
+		n -= chunk;
+	}
+	if (pipe->kick)
+		pipe->kick(pipe);
+}
+
+/* Scatter n bytes from the ring over iov */
+void
+pipe_popv (struct pipe_ringbuffer *pipe, const struct iovec *iov, size_t n)
+{
+	size_t chunk;
+
+	for (; n; iov++) {
+		chunk = iov->iov_len < n ? iov->iov_len : n;
+		pipe_pop(pipe, iov->iov_base, chunk);
+		n -= chunk;
+	}
+}
+
+/* Common argument checks, returns the pipe or fails the call */
+struct pipe_ringbuffer *
+vec_pipe (struct task_control_block *task, int write)
+{
+	struct pipe_ringbuffer *pipe = fd_pipe(task, task->stack->r0);
+	int iovcnt = task->stack->r2;
+
+	if (!pipe || (pipe->dev != S_IFIFO && pipe->dev != S_IMSGQ) ||
+	    (write ? pipe->writable : pipe->readable) == pipe_badop ||
+	    iovcnt < 0 || iovcnt > IOV_MAX) {
+		task->stack->r0 = -1;
+		task->status = TASK_READY;
+		return NULL;
+	}
+	return pipe;
+}
+
+int
+writev_try (struct task_control_block *task)
+{
+	struct pipe_ringbuffer *pipe = vec_pipe(task, 1);
+	const struct iovec *iov = (const struct iovec *)task->stack->r1;
+	size_t total, n;
+
+	if (!pipe)
+		return 1;
+	total = iov_total(iov, task->stack->r2);
+
+	if (pipe->dev == S_IMSGQ) {
+		if (sizeof(size_t) + total > pipe->atomic) {
+			task->stack->r0 = -1;
+			task->status = TASK_READY;
+			return 1;
+		}
+		if (pipe->size - PIPE_LEN(*pipe) < sizeof(size_t) + total)
+			return 0;
+		pipe_push(pipe, &total, sizeof(size_t));
+		n = total;
+	}
+	else {
+		n = pipe->size - PIPE_LEN(*pipe);
+		if (n < (total < pipe->atomic ? total : pipe->atomic))
+			return 0;
+		if (n > total)
+			n = total;
+	}
+	pipe_pushv(pipe, iov, n);
+
+	task->stack->r0 = n;
+	task->status = TASK_READY;
+	pipe_wake(pipe);
+	return 1;
+}
+
+int
+readv_try (struct task_control_block *task)
+{
+	struct pipe_ringbuffer *pipe = vec_pipe(task, 0);
+	const struct iovec *iov = (const struct iovec *)task->stack->r1;
+	size_t total, n;
+
+	if (!pipe)
+		return 1;
+	total = iov_total(iov, task->stack->r2);
+
+	if (pipe->dev == S_IMSGQ) {
+		if (PIPE_LEN(*pipe) < sizeof(size_t))
+			return 0;
+		pipe_peek(pipe, &n, sizeof(size_t));
+		if (n > total) {
+			task->stack->r0 = -1;
+			task->status = TASK_READY;
+			return 1;
+		}
+		pipe->start += sizeof(size_t);
+	}
+	else {
+		n = PIPE_LEN(*pipe);
+		if (n < (total < pipe->lowat ? total : pipe->lowat))
+			return 0;
+		if (n > total)
+			n = total;
+	}
+	pipe_popv(pipe, iov, n);
+
+	task->stack->r0 = n;
+	task->status = TASK_READY;
+	pipe_wake(pipe);
+	return 1;
+}
+
+int
+mq_batch_try (struct task_control_block *task)
+{
+	struct pipe_ringbuffer *pipe = vec_pipe(task, 0);
+	struct iovec *msgs = (struct iovec *)task->stack->r1;
+	int count = task->stack->r2;
+	int i;
+	size_t n;
+
+	if (!pipe)
+		return 1;
+	if (pipe->dev != S_IMSGQ) {
+		task->stack->r0 = -1;
+		task->status = TASK_READY;
+		return 1;
+	}
+	if (PIPE_LEN(*pipe) < sizeof(size_t))
+		return 0;
+
+	for (i = 0; i < count && PIPE_LEN(*pipe) >= sizeof(size_t); i++) {
+		pipe_peek(pipe, &n, sizeof(size_t));
+		if (n > msgs[i].iov_len)
+			break;
+		pipe->start += sizeof(size_t);
+		pipe_pop(pipe, msgs[i].iov_base, n);
+		msgs[i].iov_len = n;
+	}
+
+	/* Only an empty batch for a first message too large is an error */
+	task->stack->r0 = (i || !count) ? i : -1;
+	task->status = TASK_READY;
+	if (i)
+		pipe_wake(pipe);
+	return 1;
+}
+
+/* Syscalls that wait in TASK_WAIT_RETRY, dispatched on the syscall
+ * number still in the task's saved r7.  Returns 0 to keep waiting. */
+int
+retry_syscall (struct task_control_block *task)
+{
+	switch (task->stack->r7) {
+	case 0x19: /* splice */
+		return splice_try(task);
+	case 0x1a: /* writev */
+		return writev_try(task);
+	case 0x1b: /* readv */
+		return readv_try(task);
+	case 0x1c: /* mq_receive_batch */
+		return mq_batch_try(task);
+	}
+	return 1;
+}
+
+void
+vec_start (struct task_control_block *task)
+{
+	if (retry_syscall(task) || fd_wouldblock(task, task->stack->r0))
+		return;
+	retry_wait(task, fd_pipe(task, task->stack->r0));
+}
+
+/* Fast-path syscalls, serviced by SVC_Handler in handler mode without
+ * entering the kernel loop.  A handler returns SYSCALL_DONE to go straight
+ * back to the caller, SYSCALL_RESCHED when it completed but may have woken
+ * another task, or SYSCALL_SLOW to take the full kernel path untouched. */
+#define SYSCALL_SLOW    -1
+#define SYSCALL_DONE     0
+#define SYSCALL_RESCHED  1
+
+int
+fast_getpid (struct user_thread_stack *frame)
+{
+	frame->r0 = tasks[current_task].pid;
+	return SYSCALL_DONE;
+}
+
+int
+fast_getpriority (struct user_thread_stack *frame)
+{
+	int who = frame->r0;
+	if (who > 0 && task_lookup(who))
+		frame->r0 = task_lookup(who)->priority;
+	else if (who == 0)
+		frame->r0 = tasks[current_task].priority;
+	else
+		frame->r0 = -1;
+	return SYSCALL_DONE;
+}
+
+/* Complete a read or write that does not block.  The task's stack pointer
+ * is aimed at the exception frame, which is where the pipe handlers look
+ * for arguments; the kernel path reloads it on the next full entry. */
+int
+fast_pipe (struct user_thread_stack *frame, int write)
+{
+	struct task_control_block *task = &tasks[current_task];
+	struct pipe_ringbuffer *pipe = fd_pipe(task, frame->r0);
+	int ready;
+
+	if (!pipe) {
+		frame->r0 = -1;
+		return SYSCALL_DONE;
+	}
+	task->stack = frame;
+	ready = write ? pipe->writable(pipe, task) : pipe->readable(pipe, task);
+	if (!ready) {
+		if (task->status == TASK_READY ||
+		    fd_wouldblock(task, frame->r0))
+			return SYSCALL_DONE;	/* Error already in r0 */
+		task->status = TASK_READY;
+		return SYSCALL_SLOW;	/* Would block */
+	}
+	if (write)
+		frame->r0 = pipe->write(pipe, task);
+	else
+		frame->r0 = pipe->read(pipe, task);
+	if (!PIPE_WAITERS(pipe))
+		return SYSCALL_DONE;
+	pipe_wake(pipe);
+	return SYSCALL_RESCHED;
+}
+
+int
+fast_read (struct user_thread_stack *frame)
+{
+	return fast_pipe(frame, 0);
+}
+
+int
+fast_write (struct user_thread_stack *frame)
+{
+	return fast_pipe(frame, 1);
+}
+
+int
+fast_mknod (struct user_thread_stack *frame)
+{
+	struct pipe_ringbuffer *pipe = fd_pipe(&tasks[current_task], frame->r0);
+
+	if (pipe)
+		frame->r0 = _mknod(pipe, frame->r2,
+		                   (const struct pipe_attr *)frame->r3);
+	else
+		frame->r0 = -1;
+	return SYSCALL_DONE;
+}
+
+int
+fast_open (struct user_thread_stack *frame)
+{
+	frame->r0 = path_open(&tasks[current_task], (const char *)frame->r0,
+	                      frame->r1);
+	return SYSCALL_DONE;
+}
+
+int
+fast_mkfile (struct user_thread_stack *frame)
+{
+	frame->r0 = path_create((const char *)frame->r0, frame->r2,
+	                        (const struct pipe_attr *)frame->r3);
+	return SYSCALL_DONE;
+}
+
+int
+fast_unlink (struct user_thread_stack *frame)
+{
+	frame->r0 = path_unlink((const char *)frame->r0);
+	return SYSCALL_DONE;
+}
+
+int
+fast_close (struct user_thread_stack *frame)
+{
+	frame->r0 = fd_close(&tasks[current_task], frame->r0);
+	return SYSCALL_DONE;
+}
+
+int
+fast_dup2 (struct user_thread_stack *frame)
+{
+	frame->r0 = fd_dup2(&tasks[current_task], frame->r0, frame->r1);
+	return SYSCALL_DONE;
+}
+
+/* Only a poll that has nothing to wait for completes here */
+int
+fast_poll (struct user_thread_stack *frame)
+{
+	struct task_control_block *task = &tasks[current_task];
+	int ready;
+
+	task->stack = frame;
+	ready = poll_scan(task, 0);
+	if (!ready && (int)frame->r2 != 0)
+		return SYSCALL_SLOW;
+	frame->r0 = ready;
+	return SYSCALL_DONE;
+}
+
+int
+fast_fcntl (struct user_thread_stack *frame)
+{
+	frame->r0 = fd_fcntl(&tasks[current_task], frame->r0, frame->r1,
+	                     frame->r2);
+	return SYSCALL_DONE;
+}
+
+int
+fast_msgbuf_get (struct user_thread_stack *frame)
+{
+	frame->r0 = (unsigned int)msgbuf_get();
+	return SYSCALL_DONE;
+}
+
+int
+fast_msgbuf_put (struct user_thread_stack *frame)
+{
+	frame->r0 = msgbuf_put((void *)frame->r0);
+	return SYSCALL_DONE;
+}
+
+int
+fast_notify (struct user_thread_stack *frame)
+{
+	struct task_control_block *task = &tasks[current_task];
+
+	task->stack = frame;
+	return notify_set(task) ? SYSCALL_RESCHED : SYSCALL_DONE;
+}
+
+int
+fast_event_set (struct user_thread_stack *frame)
+{
+	struct task_control_block *task = &tasks[current_task];
+
+	task->stack = frame;
+	return event_update(task, 1) ? SYSCALL_RESCHED : SYSCALL_DONE;
+}
+
+int
+fast_event_clear (struct user_thread_stack *frame)
+{
+	struct task_control_block *task = &tasks[current_task];
+
+	task->stack = frame;
+	event_update(task, 0);
+	return SYSCALL_DONE;
+}
+
+int
+fast_mutex_unlock (struct user_thread_stack *frame)
+{
+	struct task_control_block *task = &tasks[current_task];
+
+	task->stack = frame;
+	return _mutex_unlock(task) ? SYSCALL_RESCHED : SYSCALL_DONE;
+}
+
+int
+fast_sem_post (struct user_thread_stack *frame)
+{
+	struct task_control_block *task = &tasks[current_task];
+
+	task->stack = frame;
+	return _sem_post(task) ? SYSCALL_RESCHED : SYSCALL_DONE;
+}
+
+int
+fast_futex_wake (struct user_thread_stack *frame)
+{
+	struct task_control_block *task = &tasks[current_task];
+
+	task->stack = frame;
+	return _futex_wake(task) ? SYSCALL_RESCHED : SYSCALL_DONE;
+}
+
+int (*const syscall_fast[]) (struct user_thread_stack *) = {
+	[0x2] = fast_getpid,
+	[0x3] = fast_write,
+	[0x4] = fast_read,
+	[0x6] = fast_getpriority,
+	[0x8] = fast_mknod,
+	[0xa] = fast_open,
+	[0xb] = fast_mkfile,
+	[0xc] = fast_unlink,
+	[0xd] = fast_close,
+	[0xe] = fast_dup2,
+	[0xf] = fast_poll,
+	[0x10] = fast_read,	/* Only the blocking case needs the timeout */
+	[0x11] = fast_write,
+	[0x13] = fast_fcntl,
+	[0x17] = fast_msgbuf_get,
+	[0x18] = fast_msgbuf_put,
+	[0x1d] = fast_notify,
+	[0x1f] = fast_event_set,
+	[0x20] = fast_event_clear,
+	[0x23] = fast_mutex_unlock,
+	[0x25] = fast_sem_post,
+	[0x27] = fast_futex_wake,
+};
+const size_t syscall_fast_count = sizeof(syscall_fast) / sizeof(syscall_fast[0]);
+
+/*Global variables: kernel state*/
+unsigned int stacks[TASK_LIMIT][STACK_SIZE];
+struct task_list wait_list;	/* Tasks waiting for an interrupt */
+int timeup = 0;	/* A tick ended the current time slice */
+
+/* Slot for a new task, a freed one first, or NULL if all are in use */
+struct task_control_block *
+task_alloc (void)
+{
+	struct task_control_block *task = task_free;
+
+	if (task) {
+		task_free = task->next;
+		return task;
+	}
+	if (task_count == TASK_LIMIT)
+		return NULL;
+	task = &tasks[task_count];
+	task->pid = task_count++;
+	return task;
+}
+
+/* Set up the rest of a new task, whose stack is in place, and make it
+ * ready.  Open files are shared with the parent. */
+void
+task_create (struct task_control_block *parent,
+             struct task_control_block *task, int priority)
+{
+	size_t i;
+
+	task->parent = parent;
+	task->status = TASK_READY;
+	task->priority = priority;
+	task->base_priority = priority;
+	task->waits_for = NULL;
+	task->prev = NULL;
+	task->next = NULL;
+	task->list = NULL;
+	task->timer_prev = NULL;
+	task->timer_next = NULL;
+	task->notify = 0;
+	memcpy(task->fds, parent->fds, FD_LIMIT);
+	task->fd_nonblock = parent->fd_nonblock;
+	for (i = 0; i < FD_LIMIT; i++)
+		if (task->fds[i])
+			pipes[task->fds[i] - 1].refs++;
+	ready_push(task);
+}
+
+/* spawn(entry, arg, stack_size, priority): start entry(arg) on a fresh
+ * frame instead of a copy of the caller's stack.  Every task has its
+ * STACK_SIZE slot, so stack_size is only checked against it, 0 for the
+ * whole slot. */
+void
+_spawn (struct task_control_block *parent)
+{
+	struct task_control_block *task;
+	size_t stack_size = parent->stack->r2;
+	int priority = parent->stack->r3;
+
+	if (stack_size > sizeof(stacks[0]) || !parent->stack->r0 ||
+	    (task = task_alloc()) == NULL) {
+		parent->stack->r0 = -1;
+		return;
+	}
+	priority = (priority < 0) ? 0 :
+	           ((priority > PRIORITY_LIMIT) ? PRIORITY_LIMIT : priority);
+	task->stack = init_frame(stacks[task - tasks],
+	                         (void (*)())parent->stack->r0,
+	                         (void *)parent->stack->r1);
+	task_create(parent, task, priority);
+	parent->stack->r0 = task->pid;
+}
+
+/* Back on task_free, with the next pid for the slot */
+void
+task_release (struct task_control_block *task)
+{
+	task->status = TASK_FREE;
+	task->parent = NULL;
+	task->pid += TASK_LIMIT;
+	task->next = task_free;
+	task_free = task;
+}
+
+/* Hand a zombie's status to its parent blocked in waitpid, if the wait
+ * covers it.  Returns nonzero if the zombie was reaped. */
+int
+task_reap (struct task_control_block *task)
+{
+	struct task_control_block *parent = task->parent;
+	int pid = parent->stack->r0;
+
+	if (parent->status != TASK_WAIT_CHILD || (pid != -1 && pid != task->pid))
+		return 0;
+	if (parent->stack->r1)
+		*(int *)parent->stack->r1 = task->exit_status;
+	parent->stack->r0 = task->pid;
+	parent->status = TASK_READY;
+	ready_push(parent);
+	task_release(task);
+	return 1;
+}
+
+/* End a task, running or blocked: drop it from whatever it waits on, close
+ * its files, and fail the calls of tasks blocked on it.  Mutexes it held
+ * with waiters pass to them with -EOWNERDEAD, as do the ones without on
+ * their next mutex_lock.  It stays a zombie until its parent collects the
+ * status; orphans go straight back. */
+void
+task_exit (struct task_control_block *task, int status)
+{
+	struct task_control_block *waited = task->waits_for;
+	struct task_list *list = task->list;
+	struct task_control_block *other;
+	unsigned int slot = task - tasks;
+	size_t i;
+
+	task_remove(task);
+	if (list >= ready_list && list <= &ready_list[PRIORITY_LIMIT] && !list->head)
+		ready_bitmap[task->priority >> 5] &= ~READY_BIT(task->priority);
+	timer_remove(task);
+	task->waits_for = NULL;
+	task_reprioritize(waited);
+	for (i = 0; i < FD_LIMIT; i++)
+		fd_close(task, i);
+	for (i = 0; i < PIPE_LIMIT; i++) {
+		pipes[i].pollers &= ~(1 << slot);
+		if (pipes[i].owner == task)
+			pipes[i].owner = NULL;
+	}
+	notify_pending &= ~(0x80000000 >> slot);
+	task->notify = 0;
+
+	for (i = 0; i < task_count; i++) {
+		other = &tasks[i];
+		if (other->waits_for == task && other->status == TASK_WAIT_MUTEX) {
+			/* Handed the mutex below, once this task is gone */
+			other->waits_for = NULL;
+		}
+		else if (other->waits_for == task) {
+			/* Senders, clients awaiting a reply */
+			other->waits_for = NULL;
+			task_remove(other);
+			timer_remove(other);
+			other->stack->r0 = -1;
+			other->status = TASK_READY;
+			ready_push(other);
+		}
+		if (other->parent == task && other->status != TASK_FREE) {
+			other->parent = NULL;
+			if (other->status == TASK_ZOMBIE)
+				task_release(other);
+		}
+	}
+
+	task->priority = task->base_priority;
+	task->exit_status = status;
+	task->status = TASK_ZOMBIE;
+	if (!task->parent)
+		task_release(task);
+	else
+		task_reap(task);
+
+	for (i = 0; i < task_count; i++)
+		if (tasks[i].status == TASK_WAIT_MUTEX && !tasks[i].waits_for)
+			mutex_handoff((unsigned int *)tasks[i].stack->r0, -EOWNERDEAD);
+}
+
+/* waitpid(pid, &status, options): pid -1 waits for any child */
+void
+_waitpid (struct task_control_block *task)
+{
+	int pid = task->stack->r0;
+	struct task_control_block *child;
+	int found = 0;
+	size_t i;
+
+	for (i = 0; i < task_count; i++) {
+		child = &tasks[i];
+		if (child->parent != task || child->status == TASK_FREE ||
+		    (pid != -1 && pid != child->pid))
+			continue;
+		found = 1;
+		if (child->status == TASK_ZOMBIE) {
+			if (task->stack->r1)
+				*(int *)task->stack->r1 = child->exit_status;
+			task->stack->r0 = child->pid;
+			task_release(child);
+			return;
+		}
+	}
+	if (!found)
+		task->stack->r0 = -1;
+	else if (task->stack->r2 & WNOHANG)
+		task->stack->r0 = 0;
+	else
+		task->status = TASK_WAIT_CHILD;
+}
+
+/* kill(pid): task 0 runs the idle loop and cannot be killed */
+void
+_kill (struct task_control_block *task)
+{
+	struct task_control_block *target = task_lookup(task->stack->r0);
+
+	if (!target || target == &tasks[0] || target->status == TASK_ZOMBIE) {
+		task->stack->r0 = -1;
+		return;
+	}
+	task->stack->r0 = 0;
+	task_exit(target, -1);
+}
+
+/* Handle a syscall or interrupt from current_task, event is the syscall
+ * number or the negated exception number */
+void kernel_service(unsigned int event)
+{
+	struct task_control_block *task;
+
+	switch (event) {
+	case 0x0: /* reschedule after a fast-path syscall */
+		/* Calls whose syscall_fast[] handler never falls back to this
+		 * path, getpid or close for instance, are only handled there */
+		break;
+	case 0x1: /* fork */
+		if ((task = task_alloc()) == NULL) {
+			/* Cannot create a new task, return error */
+			tasks[current_task].stack->r0 = -1;
+		}
+		else {
+			/* Compute how much of the stack is used */
+			size_t used = stacks[current_task] + STACK_SIZE
+				      - (unsigned int*)tasks[current_task].stack;
+			/* New stack is END - used */
+			task->stack = (void*)(stacks[task - tasks] + STACK_SIZE - used);
+			/* Copy only the used part of the stack */
+			memcpy(task->stack, tasks[current_task].stack,
+			       used * sizeof(unsigned int));
+			/* Priority inherited from forked task */
+			task_create(&tasks[current_task], task,
+			            tasks[current_task].base_priority);
+			/* Set return values in each process */
+			tasks[current_task].stack->r0 = task->pid;
+			task->stack->r0 = 0;
+		}
+		break;
+	case 0x3: /* write */
+		_write(&tasks[current_task]);
+		break;
+	case 0x4: /* read */
+		_read(&tasks[current_task]);
+		break;
+	case 0x5: /* interrupt_wait */
+	case 0x12: /* interrupt_wait_timeout */
+		/* Enable interrupt */
+		NVIC_EnableIRQ(tasks[current_task].stack->r0);
+		/* Block task waiting for interrupt to happen */
+		tasks[current_task].status = TASK_WAIT_INTR;
+		task_push(&wait_list, &tasks[current_task]);
+		if (event == 0x12)
+			timer_bound(&tasks[current_task], tasks[current_task].stack->r1);
+		break;
+	case 0x7: /* setpriority */
+		{
+			int who = tasks[current_task].stack->r0;
+			int value = tasks[current_task].stack->r1;
+			value = (value < 0) ? 0 : ((value > PRIORITY_LIMIT) ? PRIORITY_LIMIT : value);
+			task = who ? task_lookup(who) : &tasks[current_task];
+			if (task) {
+				task->base_priority = value;
+				task_set_priority(task, value);
+				task_reprioritize(task);
+				task_reprioritize(task->waits_for);
+			}
+			else {
+				tasks[current_task].stack->r0 = -1;
+				break;
+			}
+			tasks[current_task].stack->r0 = 0;
+		} break;
+	case 0x9: /* sleep */
+		if (tasks[current_task].stack->r0 != 0) {
+			timer_insert(&tasks[current_task],
+			             tick_count + tasks[current_task].stack->r0);
+			tasks[current_task].status = TASK_WAIT_TIME;
+		}
+		break;
+	case 0xf: /* poll */
+		poll_start(&tasks[current_task]);
+		break;
+	case 0x10: /* read_timeout */
+		_read(&tasks[current_task]);
+		timer_bound(&tasks[current_task], tasks[current_task].stack->r3);
+		break;
+	case 0x11: /* write_timeout */
+		_write(&tasks[current_task]);
+		timer_bound(&tasks[current_task], tasks[current_task].stack->r3);
+		break;
+	case 0x14: /* msg_send */
+		_msg_send(&tasks[current_task]);
+		break;
+	case 0x15: /* msg_receive */
+		_msg_receive(&tasks[current_task]);
+		break;
+	case 0x16: /* msg_reply */
+		_msg_reply(&tasks[current_task]);
+		break;
+	case 0x19: /* splice */
+		splice_start(&tasks[current_task]);
+		break;
+	case 0x1a: /* writev */
+	case 0x1b: /* readv */
+	case 0x1c: /* mq_receive_batch */
+		vec_start(&tasks[current_task]);
+		break;
+	case 0x1e: /* notify_wait */
+		_notify_wait(&tasks[current_task]);
+		break;
+	case 0x21: /* event_wait */
+		_event_wait(&tasks[current_task]);
+		break;
+	case 0x22: /* mutex_lock */
+		_mutex_lock(&tasks[current_task]);
+		break;
+	case 0x24: /* sem_wait */
+		_sem_wait(&tasks[current_task]);
+		break;
+	case 0x26: /* futex_wait */
+		_futex_wait(&tasks[current_task]);
+		break;
+	case 0x28: /* spawn */
+		_spawn(&tasks[current_task]);
+		break;
+	case 0x29: /* exit */
+		task_exit(&tasks[current_task], tasks[current_task].stack->r0);
+		break;
+	case 0x2a: /* waitpid */
+		_waitpid(&tasks[current_task]);
+		break;
+	case 0x2b: /* kill */
+		_kill(&tasks[current_task]);
+		break;
+	default: /* Catch all interrupts */
+		if ((int)event < 0) {
+			unsigned int intr = -event - 16;
+
+			if (intr == SysTick_IRQn) {
+				/* Never disable timer. We need it for pre-emption */
+				timeup = 1;
+				tick_count++;
+				timer_expire(tick_count);
+			}
+			else if (irq_handlers[intr]) {
+				/* The handler has run, wake the tasks it left pending */
+				pipe_wake_pending();
+				event_wake_pending();
+			}
+			else {
+				/* Disable interrupt, interrupt_wait re-enables */
+				NVIC_DisableIRQ(intr);
+
+				/* Unblock any tasks waiting for it */
+				for (task = wait_list.head; task != NULL;) {
+					struct task_control_block *next = task->next;
+					if (task->stack->r0 == intr) {
+						task->status = TASK_READY;
+						timer_remove(task);
+						ready_push(task);
+					}
+					task = next;
+				}
+			}
+		}
+	}
+}
+
+/* Pick the task to run next into current_task */
+void schedule(void)
+{
+	int keep = tasks[current_task].status == TASK_READY && !timeup &&
+	           ready_highest() >= tasks[current_task].priority;
+
+	timeup = 0;
+	if (keep)
+		/* Current task has highest priority and remains execution time */
+		return;
+	if (tasks[current_task].status == TASK_READY)
+		ready_push(&tasks[current_task]);
+	current_task = ready_pop() - tasks;
+	current_pid = tasks[current_task].pid;
+}
+
+void tickless_resume(void)
+{
+#if configUSE_TICKLESS_IDLE
+	/* Only when idling: a busy task keeps the periodic tick, so that its
+	 * syscalls do not stop and reload SysTick on every round trip */
+	if (tasks[current_task].priority == PRIORITY_LIMIT &&
+	    !ready_list[PRIORITY_LIMIT].head)
+		tickless_enter(timer_list ? timer_list->wakeup - tick_count
+		                          : TICKLESS_MAX);
+#endif
+}
+
+#if configUSE_PENDSV_SWITCH
+/* Kernel entry for SVC and interrupts, called in handler mode with the
+ * task's registers laid out below its exception frame.  Switching is left
+ * to PendSV so that wakeups from back-to-back entries share one switch. */
+void kernel_entry(struct user_thread_stack *stack)
+{
+	int highest;
+
+#if configUSE_TICKLESS_IDLE
+	tick_count += tickless_exit();
+#endif
+	tasks[current_task].stack = stack;
+	/* Only a syscall shows that the task is running.  An interrupt can
+	 * tail-chain ahead of the PendSV that switches away from a task that
+	 * just blocked or exited, which must stay that way. */
+	if ((int)stack->r7 >= 0)
+		tasks[current_task].status = TASK_READY;
+	kernel_service(stack->r7);
+
+	highest = ready_highest();
+	if (tasks[current_task].status != TASK_READY ||
+	    highest < tasks[current_task].priority ||
+	    (timeup && highest == tasks[current_task].priority)) {
+		SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+	}
+	else {
+		timeup = 0;
+		tickless_resume();
+	}
+}
+
+/* Called from PendSV_Handler with the outgoing task's saved context,
+ * returns the context to resume */
+struct user_thread_stack *pendsv_switch(struct user_thread_stack *stack)
+{
+	tasks[current_task].stack = stack;
+	schedule();
+	tickless_resume();
+	return tasks[current_task].stack;
+}
+#endif
+
+int main()
+{
+	size_t i;
+
+	SysTick_Config(configCPU_CLOCK_HZ / configTICK_RATE_HZ);
+
+	init_rs232();
+	__enable_irq();
+
+	tasks[task_count].stack = (void*)init_task(stacks[task_count], &first);
+	tasks[task_count].pid = 0;
+	tasks[task_count].priority = PRIORITY_DEFAULT;
+	tasks[task_count].base_priority = PRIORITY_DEFAULT;
+	task_count++;
+
+	/* Initialize all pipes */
+	for (i = 0; i < PIPE_LIMIT; i++) {
+		pipes[i].start = pipes[i].end = 0;
+		pipes[i].data = NULL;
+		pipes[i].irq = -1;
+		pipes[i].pollers = 0;
+		task_list_init(&pipes[i].readers);
+		task_list_init(&pipes[i].writers);
+		pipes[i].next = pipe_free;
+		pipe_free = &pipes[i];
+	}
+
+	/* Initialize the name table */
+	for (i = 0; i < PATH_HASH; i++)
+		path_hash[i] = NULL;
+	for (i = 0; i < PATH_LIMIT; i++) {
+		path_entries[i].next = path_free;
+		path_free = &path_entries[i];
+	}
+
+	/* Initialize ready lists */
+	for (i = 0; i <= PRIORITY_LIMIT; i++)
+		task_list_init(&ready_list[i]);
+	for (i = 0; i < READY_BITMAP_WORDS; i++)
+		ready_bitmap[i] = 0;
+	task_list_init(&wait_list);
+	for (i = 0; i < EVENT_LIMIT; i++)
+		task_list_init(&event_groups[i].waiters);
+
+	/* Kernel entries never nest, so tty_irq never interrupts the kernel
+	 * in the middle of a pipe operation */
+	NVIC_SetPriority(SysTick_IRQn, 0);
+
+	/* The first task starts with the console as stdin and stdout */
+	tty_init(&tty0, USART2);
+	fd_alloc(&tasks[0], tty0.in);
+	fd_alloc(&tasks[0], tty0.out);
+
+#if configUSE_PENDSV_SWITCH
+	/* The deferred switch runs below all kernel entries */
+	NVIC_SetPriority(PendSV_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
+
+	/* Start the first task.  From here on the kernel runs only in
+	 * exception handlers, so this never returns. */
+	activate(tasks[current_task].stack);
+#else
+	while (1) {
+		tickless_resume();
+		tasks[current_task].stack = activate(tasks[current_task].stack);
+#if configUSE_TICKLESS_IDLE
+		tick_count += tickless_exit();
+#endif
+		tasks[current_task].status = TASK_READY;
+		kernel_service(tasks[current_task].stack->r7);
+		schedule();
+	}
+#endif
 
 	return 0;
 }
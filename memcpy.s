@@ -19,11 +19,13 @@ memcpy:
 	subcs   r2, r2, #2
 	strhcs  r3, [r0], #2		/* Save if 2 bytes unaligned */
 	ittt    mi
-	strbmi  r3, [r1] ,#1		/* Load if 1 byte unaligned */
+	ldrbmi  r3, [r1] ,#1		/* Load if 1 byte unaligned */
 	submi   r2, r2, #1
 	strbmi  r3, [r0] ,#1		/* Save if 1 byte unaligned */
 
 aligned:
+	tst     r0, #3
+	bne     unaligned_dst
 	push    {r4 - r10}
 	subs 	r2, #32		 
 	blo     less_than_32_bytes
@@ -51,6 +53,20 @@ less_than_32_bytes:
 	
 	pop     {r4 - r10}
 	
+	b       less_than_4_bytes
+
+unaligned_dst:
+	/* LDM/STM fault on an unaligned address, LDR/STR do not */
+	subs    r2, #4
+	blo     less_than_4_words
+word_loop:
+	ldr     r3, [r1], #4
+	subs    r2, #4
+	str     r3, [r0], #4
+	bhs     word_loop
+less_than_4_words:
+	lsls    r2, r2, #30         /* Adjust r2 for less_than_4_bytes */
+
 less_than_4_bytes:
 	it      ne
 	ldrne   r3, [r1]    		/* Load if ether 2 bytes or 1 byte remained */
@@ -3,16 +3,179 @@
 void *activate(void *stack);
 
 int fork();
+/* Start entry(arg) as a new task, returns its pid or -1.  stack_size 0
+ * takes the whole stack slot. */
+int spawn(void (*entry)(), void *arg, size_t stack_size, int priority);
 int getpid();
+/* Tasks end with exit(status), or returning from a spawned entry.  A
+ * parent collects the status of its children with waitpid, pid -1 for any
+ * of them.  Pids are not reused while a slot is recycled. */
+#define WNOHANG 1
+void exit(int status);
+int waitpid(int pid, int *status, int options);
+int kill(int pid);
+
+/* Every task starts with the console tty open on these */
+#define STDIN_FILENO  0
+#define STDOUT_FILENO 1
 
 int write(int fd, const void *buf, size_t count);
 int read(int fd, void *buf, size_t count);
 
 void interrupt_wait(int intr);
 
+/* Returned, negated, by the _timeout calls when ticks pass first */
+#define ETIMEDOUT 110
+
+/* ticks < 0 waits forever, 0 fails at once instead of blocking */
+int read_timeout(int fd, void *buf, size_t count, int ticks);
+int write_timeout(int fd, const void *buf, size_t count, int ticks);
+int interrupt_wait_timeout(int intr, int ticks);
+
 int getpriority(int who);
 int setpriority(int who, int value);
 
-int mknod(int fd, int mode, int dev);
+/* Pipe geometry for mknod, zero fields select the PIPE_BUF default */
+struct pipe_attr {
+	size_t capacity;	/* Bytes buffered, rounded up to a power of two */
+	size_t atomic;		/* Largest write or message accepted at once */
+	int irq;		/* S_IFIRQ: device interrupt to deliver */
+	int flags;		/* S_IFIRQ: IRQ_TIMESTAMP */
+	size_t lowat;		/* S_IFIFO: bytes a read waits for, default 1 */
+	unsigned int exti;	/* S_IFIRQ: EXTI lines to acknowledge, else the
+				 * IRQ is masked after each event until a read */
+};
+
+/* Queue the tick of each event rather than just counting them */
+#define IRQ_TIMESTAMP 1
+
+int mknod(int fd, int mode, int dev, const struct pipe_attr *attr);
 
 void sleep(unsigned int);
+
+/* flags for open and fcntl: calls that would block fail with -EAGAIN */
+#define O_NONBLOCK 0x800
+#define EAGAIN 11
+
+#define F_GETFL 3
+#define F_SETFL 4
+
+int open(const char *pathname, int flags);
+int fcntl(int fd, int cmd, int arg);
+int mkfile(const char *pathname, int mode, int dev,
+           const struct pipe_attr *attr);
+int unlink(const char *pathname);
+int close(int fd);
+int dup2(int oldfd, int newfd);
+
+#define POLLIN   0x1	/* A read would not block */
+#define POLLOUT  0x4	/* A write of up to the atomic size would not block */
+#define POLLNVAL 0x20	/* fd is not open */
+
+struct pollfd {
+	int fd;
+	short events;	/* POLLIN and/or POLLOUT */
+	short revents;	/* Filled in with the events that are ready */
+};
+
+/* timeout is in ticks, negative to wait forever */
+int poll(struct pollfd *fds, unsigned int nfds, int timeout);
+
+/* Synchronous message passing over channels, made with mknod/mkfile and
+ * S_IFCHAN.  msg_send blocks until the message is received and replied
+ * to, and returns the status given to msg_reply.  msg_receive returns the
+ * rcvid to reply to and stores the full message length in *msg_len, which
+ * may be NULL.  Messages and replies longer than the buffer are cut. */
+int msg_send(int fd, const void *msg, size_t len, void *reply, size_t reply_len);
+int msg_receive(int fd, void *buf, size_t len, size_t *msg_len);
+int msg_reply(int rcvid, int status, const void *reply, size_t len);
+
+/* Zero-copy messages: take a buffer with msgbuf_get, fill it in place and
+ * write its handle, write(fd, &buf, sizeof(buf)), to an S_IBUFQ queue.
+ * The reader gets the handle with read and hands the buffer back with
+ * msgbuf_put, the only way buffers may be freed. */
+#define MSGBUF_SIZE 64
+
+void *msgbuf_get(void);
+int msgbuf_put(void *buf);
+
+/* Move up to len bytes from fd_in to fd_out inside the kernel.  Both must
+ * be FIFOs or message queues; a message moves whole, and becomes one
+ * message on a message queue fd_out.  Returns the byte count. */
+#define SPLICE_F_NONBLOCK 2
+
+int splice(int fd_in, int fd_out, size_t len, unsigned int flags);
+
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+
+/* Gather or scatter one read or write, or one message on a message
+ * queue.  At most IOV_MAX (8) buffers. */
+int writev(int fd, const struct iovec *iov, int iovcnt);
+int readv(int fd, const struct iovec *iov, int iovcnt);
+
+/* Receive up to count messages, one into each buffer, in a single call.
+ * Waits for the first; iov_len is set to each message's length.  Returns
+ * the number of messages. */
+int mq_receive_batch(int fd, struct iovec *msgs, int count);
+
+/* Task notifications and event groups 0 to 3.  A wait returns the bits of
+ * mask that were set: any of them, or with EV_ALL all of them.  EV_CLEAR
+ * clears the returned bits.  ticks as for the _timeout calls. */
+#define EV_ALL   1
+#define EV_CLEAR 2
+
+int notify(int pid, unsigned int bits);
+int notify_wait(unsigned int mask, int flags, int ticks);
+int event_set(int group, unsigned int bits);
+int event_clear(int group, unsigned int bits);
+int event_wait(int group, unsigned int mask, int flags, int ticks);
+
+/* Mutexes with priority inheritance and counting semaphores, which live
+ * in the caller's memory.  Initialise a mutex to MUTEX_INIT and a
+ * semaphore to SEM_INIT(count).  Only blocking and waking enter the
+ * kernel.  A mutex is released by its owner, and is not recursive. */
+struct mutex {
+	unsigned int owner;
+};
+
+struct semaphore {
+	unsigned int count;
+};
+
+#define MUTEX_INIT { 0 }
+
+/* mutex_lock returns this, with the mutex held, when its owner exited
+ * without unlocking it */
+#define EOWNERDEAD 130
+#define SEM_INIT(count) { (count) }
+
+int mutex_lock(struct mutex *mutex);
+int mutex_trylock(struct mutex *mutex);
+int mutex_unlock(struct mutex *mutex);
+int sem_wait(struct semaphore *sem);
+int sem_trywait(struct semaphore *sem);
+int sem_post(struct semaphore *sem);
+
+/* Futexes: futex_wait blocks while *word == value, or returns -EAGAIN
+ * at once, and futex_wake wakes up to count of its waiters */
+int futex_wait(unsigned int *word, unsigned int value, int ticks);
+int futex_wake(unsigned int *word, int count);
+
+/* Single producer, single consumer byte ring in shared memory, size a
+ * power of two.  Reads and writes are partial and block only while the
+ * ring is empty or full; only blocking and waking enter the kernel. */
+struct ring {
+	volatile unsigned int head;
+	volatile unsigned int tail;
+	unsigned int size;
+	unsigned char *data;
+	volatile unsigned int reader_waits;
+	volatile unsigned int writer_waits;
+};
+
+void ring_init(struct ring *ring, void *data, unsigned int size);
+int ring_write(struct ring *ring, const void *buf, unsigned int len);
+int ring_read(struct ring *ring, void *buf, unsigned int len);
@@ -75,3 +75,358 @@ sleep:
 	nop
 	pop {r7}
 	bx lr
+.global open
+open:
+	push {r7}
+	mov r7, #0xa
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global mkfile
+mkfile:
+	push {r7}
+	mov r7, #0xb
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global unlink
+unlink:
+	push {r7}
+	mov r7, #0xc
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global close
+close:
+	push {r7}
+	mov r7, #0xd
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global dup2
+dup2:
+	push {r7}
+	mov r7, #0xe
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global poll
+poll:
+	push {r7}
+	mov r7, #0xf
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global read_timeout
+read_timeout:
+	push {r7}
+	mov r7, #0x10
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global write_timeout
+write_timeout:
+	push {r7}
+	mov r7, #0x11
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global interrupt_wait_timeout
+interrupt_wait_timeout:
+	push {r7}
+	mov r7, #0x12
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global fcntl
+fcntl:
+	push {r7}
+	mov r7, #0x13
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global msg_send
+msg_send:
+	push {r4, r7}
+	ldr r4, [sp, #8]	/* reply_len, passed on the stack */
+	mov r7, #0x14
+	svc 0
+	nop
+	pop {r4, r7}
+	bx lr
+.global msg_receive
+msg_receive:
+	push {r7}
+	mov r7, #0x15
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global msg_reply
+msg_reply:
+	push {r7}
+	mov r7, #0x16
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global msgbuf_get
+msgbuf_get:
+	push {r7}
+	mov r7, #0x17
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global msgbuf_put
+msgbuf_put:
+	push {r7}
+	mov r7, #0x18
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global splice
+splice:
+	push {r7}
+	mov r7, #0x19
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global writev
+writev:
+	push {r7}
+	mov r7, #0x1a
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global readv
+readv:
+	push {r7}
+	mov r7, #0x1b
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global mq_receive_batch
+mq_receive_batch:
+	push {r7}
+	mov r7, #0x1c
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global notify
+notify:
+	push {r7}
+	mov r7, #0x1d
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global notify_wait
+notify_wait:
+	push {r7}
+	mov r7, #0x1e
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global event_set
+event_set:
+	push {r7}
+	mov r7, #0x1f
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global event_clear
+event_clear:
+	push {r7}
+	mov r7, #0x20
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global event_wait
+event_wait:
+	push {r7}
+	mov r7, #0x21
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+
+	/* Mutexes and semaphores: LDREX/STREX on the user's word, trapping
+	 * into the kernel only to block or to wake a blocked task */
+.global mutex_lock
+mutex_lock:
+	ldr r1, =current_pid
+	ldr r1, [r1]
+	add r1, r1, #1
+1:	ldrex r2, [r0]
+	cbnz r2, 2f
+	strex r3, r1, [r0]
+	cmp r3, #0
+	bne 1b
+	dmb
+	mov r0, #0
+	bx lr
+2:	clrex
+	push {r7}
+	mov r7, #0x22
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global mutex_trylock
+mutex_trylock:
+	ldr r1, =current_pid
+	ldr r1, [r1]
+	add r1, r1, #1
+1:	ldrex r2, [r0]
+	cbnz r2, 2f
+	strex r3, r1, [r0]
+	cmp r3, #0
+	bne 1b
+	dmb
+	mov r0, #0
+	bx lr
+2:	clrex
+	mov r0, #-1
+	bx lr
+.global mutex_unlock
+mutex_unlock:
+	ldr r1, =current_pid
+	ldr r1, [r1]
+	add r1, r1, #1
+	mov r2, #0
+	dmb
+1:	ldrex r3, [r0]
+	cmp r3, r1
+	bne 2f			/* Waiters, or not the owner */
+	strex r3, r2, [r0]
+	cmp r3, #0
+	bne 1b
+	mov r0, #0
+	bx lr
+2:	clrex
+	push {r7}
+	mov r7, #0x23
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global sem_wait
+sem_wait:
+1:	ldrex r1, [r0]
+	bics r2, r1, #0x80000000
+	beq 2f
+	sub r1, r1, #1
+	strex r3, r1, [r0]
+	cmp r3, #0
+	bne 1b
+	dmb
+	mov r0, #0
+	bx lr
+2:	clrex
+	push {r7}
+	mov r7, #0x24
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global sem_trywait
+sem_trywait:
+1:	ldrex r1, [r0]
+	bics r2, r1, #0x80000000
+	beq 2f
+	sub r1, r1, #1
+	strex r3, r1, [r0]
+	cmp r3, #0
+	bne 1b
+	dmb
+	mov r0, #0
+	bx lr
+2:	clrex
+	mov r0, #-1
+	bx lr
+.global sem_post
+sem_post:
+	dmb
+1:	ldrex r1, [r0]
+	tst r1, #0x80000000
+	bne 2f			/* Waiters */
+	add r1, r1, #1
+	strex r3, r1, [r0]
+	cmp r3, #0
+	bne 1b
+	mov r0, #0
+	bx lr
+2:	clrex
+	push {r7}
+	mov r7, #0x25
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global futex_wait
+futex_wait:
+	push {r7}
+	mov r7, #0x26
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global futex_wake
+futex_wake:
+	push {r7}
+	mov r7, #0x27
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global spawn
+spawn:
+	push {r7}
+	mov r7, #0x28
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global exit
+exit:
+	push {r7}
+	mov r7, #0x29
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global waitpid
+waitpid:
+	push {r7}
+	mov r7, #0x2a
+	svc 0
+	nop
+	pop {r7}
+	bx lr
+.global kill
+kill:
+	push {r7}
+	mov r7, #0x2b
+	svc 0
+	nop
+	pop {r7}
+	bx lr